@@ -11,6 +11,7 @@ const http = require('http');
 const url = require('url');
 const fs = require('fs');
 const path = require('path');
+const crypto = require('crypto');
 
 const PORT = parseInt(process.env.PORT || '4000', 10);
 const MAX_RECENT_EVENTS = parseInt(process.env.MAX_EVENTS || '200', 10);
@@ -125,7 +126,18 @@ async function handleRequest(req, res) {
   }
 
   if (req.method === 'GET' && pathname === '/policies') {
-    return jsonResponse(res, 200, policies);
+    const body = JSON.stringify(policies);
+    const etag = `"${crypto.createHash('sha1').update(body).digest('hex')}"`;
+    if (req.headers['if-none-match'] === etag) {
+      res.writeHead(304, { ETag: etag });
+      return res.end();
+    }
+    res.writeHead(200, {
+      'Content-Type': 'application/json',
+      'Content-Length': Buffer.byteLength(body),
+      ETag: etag
+    });
+    return res.end(body);
   }
 
   if (req.method === 'GET' && pathname.startsWith('/policy/')) {
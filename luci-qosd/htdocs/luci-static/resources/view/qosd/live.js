@@ -86,6 +86,7 @@ return view.extend({
 				E('td', {}, (h.confidence != null) ? (h.confidence + ' %') : '-'),
 				E('td', { style: 'text-align:right' }, fmtbps(h.rx_bps || 0)),
 				E('td', { style: 'text-align:right' }, fmtbps(h.tx_bps || 0)),
+				E('td', { style: 'text-align:right' }, h.rtt_us ? (h.rtt_us / 1000).toFixed(1) + ' ms' : '-'),
 				E('td', {}, h.last_seen ? new Date(h.last_seen * 1000).toLocaleTimeString() : '-')
 			]));
 
@@ -101,6 +102,7 @@ return view.extend({
 					E('th', {}, _('Confidence')),
 					E('th', {}, _('RX (bps)')),
 					E('th', {}, _('TX (bps)')),
+					E('th', {}, _('RTT')),
 					E('th', {}, _('Last seen'))
 				]),
 				...rows
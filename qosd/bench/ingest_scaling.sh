@@ -0,0 +1,67 @@
+#!/bin/sh
+#
+# Conntrack ingestion scaling: records one synthetic workload with -C, then
+# replays it through the inline sampler and through 1-8 ingest threads (-w)
+# and compares every interval with the inline run.
+#
+# The workload names more hosts than the host table holds, so it also
+# checks that the pool keeps the same hosts as the inline sampler. The
+# leased client 192.168.1.77 only shows up on the last conntrack line.
+#
+# usage: ingest_scaling.sh <qosd binary> [entries] [lan hosts] [snapshots]
+
+QOSD=${1:?usage: $0 <qosd binary> [entries] [lan hosts] [snapshots]}
+ENTRIES=${2:-20000}
+LAN=${3:-600}
+SNAPSHOTS=${4:-6}
+
+DIR=$(mktemp -d) || exit 1
+trap 'kill $GEN 2>/dev/null; rm -rf "$DIR"' EXIT
+
+echo "1700000000 02:00:00:00:01:4d 192.168.1.77 console *" > "$DIR/leases"
+echo "IP address HW type Flags HW address Mask Device" > "$DIR/arp"
+
+gen() {
+    awk -v n="$ENTRIES" -v lan="$LAN" -v pass="$1" 'BEGIN {
+        srand(1)
+        for (i = 0; i < n; i++) {
+            s = int(lan * rand() ^ 2); d = int(4000 * rand() ^ 3)
+            b = int(pass * 1000 * (1 + 50 * rand() ^ 8))
+            if (i == n - 1) { src = "192.168.1.77"; dport = 3074 }
+            else { src = sprintf("192.168.%d.%d", 2 + int(s / 250), s % 250 + 1); dport = (d % 5 ? 443 : 3074) }
+            dst = sprintf("10.%d.%d.%d", int(d / 65536), int(d / 256) % 256, d % 256)
+            printf "ipv4     2 udp      17 30 src=%s dst=%s sport=%d dport=%d packets=1 bytes=%d src=%s dst=%s sport=%d dport=%d packets=1 bytes=%d mark=0 use=1\n",
+                src, dst, 1024 + i % 60000, dport, b, dst, src, dport, 1024 + i % 60000, b
+        }
+    }' > "$DIR/nfct.tmp" && mv "$DIR/nfct.tmp" "$DIR/nfct"
+}
+
+gen 1
+(p=2; while :; do sleep 1; gen $p; p=$((p + 1)); done) &
+GEN=$!
+
+"$QOSD" -N "$DIR/nfct" -L "$DIR/leases" -A "$DIR/arp" \
+        -C "$DIR/cap.gz" -i 1 -c "$SNAPSHOTS" 2>/dev/null || exit 1
+kill $GEN
+wait $GEN 2>/dev/null
+
+"$QOSD" -X "$DIR/cap.gz" -x 1000 -o "$DIR/inline.out" > "$DIR/inline.json" || exit 1
+
+summarize() {
+    awk -v label="$1" '
+        /qosd_replay_interval/ {
+            match($0, /"wall_us":[0-9]+/); wall += substr($0, RSTART + 10, RLENGTH - 10)
+            match($0, /"cpu_us":[0-9]+/); cpu += substr($0, RSTART + 9, RLENGTH - 9)
+            match($0, /"hosts":[0-9]+/); hosts = substr($0, RSTART + 8, RLENGTH - 8)
+            if (match($0, /"diffs":[0-9]+/)) diffs += substr($0, RSTART + 8, RLENGTH - 8)
+            n++
+        }
+        END { printf "%-8s %10.1f %10.1f %8d %8d\n", label, wall / n / 1000, cpu / n / 1000, hosts, diffs }'
+}
+
+printf "%-8s %10s %10s %8s %8s\n" "mode" "wall_ms" "cpu_ms" "hosts" "diffs"
+summarize inline < "$DIR/inline.json"
+for w in 1 2 4 8; do
+    "$QOSD" -X "$DIR/cap.gz" -x 1000 -w $w -b "$DIR/inline.out" 2>/dev/null | summarize "-w $w"
+done
+grep -q "192.168.1.77" "$DIR/inline.out" || echo "192.168.1.77 missing from the inline run"
@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "qosd.h"
+
+/*
+ * qosd_classify event formatting: the shared JSON writer (qosd_json.c)
+ * against the escape-into-stack-buffers + snprintf code it replaced, which
+ * is kept here verbatim as the reference. Checks that both produce the
+ * same bytes where the old code did not truncate, then times each.
+ *
+ * usage: json_bench [events]
+ */
+
+struct sample {
+    const char *name;
+    const char *src, *dst, *proto;
+    uint16_t src_port, dst_port;
+    const char *hostname, *service_hint, *dns_name, *app_hint;
+    uint64_t bytes_total;
+    uint32_t latency_ms;
+    struct persona_result res;
+    bool truncated_before;  /* The old code cut a field at its 128 byte buffer */
+};
+
+static const struct sample g_samples[] = {
+    {
+        "typical", "192.168.1.23", "142.250.180.14", "tcp", 51234, 443,
+        "pixel-7", "", "rr3---sn-4g5e6nzl.googlevideo.com", "",
+        184467440737ULL, 23,
+        { "streaming", "medium", "boost", "AF41", 80 }, false,
+    },
+    {
+        "escaped", "fe80::1c2d:3e4f:5a6b:7c8d", "2a00:1450:4001:82b::200e", "udp", 3074, 3074,
+        "Kid's \"Switch\"", "game\tlobby", "", "xbox\\live",
+        4096, 7,
+        { "gaming", "high", "boost", "CS6", 85 }, false,
+    },
+    {
+        "long", "192.168.1.50", "151.101.1.140", "tcp", 40000, 443,
+        "living-room-media-server-with-a-very-long-dhcp-hostname-01",
+        "cdn-video-segment-download-with-range-requests-and-keepalive",
+        "a-very-long-cname-chain-target.edge-cache-node-0042.eu-central-1"
+        ".content-delivery-network.example-streaming-provider.com"
+        ".regional-shield.origin-pull.video-on-demand.example.net",
+        "com.example.streaming.android.tv.player.background.prefetch",
+        9876543210ULL, 41,
+        { "streaming", "medium", "boost", "AF41", 80 }, true,
+    },
+};
+
+/* ---- previous implementation ---- */
+
+static void iso8601_now(char *buf, size_t len)
+{
+    time_t now = time(NULL);
+    struct tm tm;
+    if (!gmtime_r(&now, &tm))
+        memset(&tm, 0, sizeof(tm));
+    strftime(buf, len, "%Y-%m-%dT%H:%M:%SZ", &tm);
+}
+
+static void json_escape(const char *in, char *out, size_t out_len)
+{
+    size_t oi = 0;
+    for (size_t i = 0; in && in[i] && oi + 1 < out_len; i++) {
+        unsigned char c = (unsigned char)in[i];
+        if (c == '"' || c == '\\') {
+            if (oi + 2 >= out_len)
+                break;
+            out[oi++] = '\\';
+            out[oi++] = c;
+        } else if (c <= 0x1F) {
+            if (oi + 6 >= out_len)
+                break;
+            int written = snprintf(out + oi, out_len - oi, "\\u%04x", c);
+            if (written < 0)
+                break;
+            oi += (size_t)written;
+        } else {
+            out[oi++] = c;
+        }
+    }
+    out[oi] = '\0';
+}
+
+static const char *router_id(void)
+{
+    static char cached[64] = {0};
+    static int initialized = 0;
+    if (!initialized) {
+        if (gethostname(cached, sizeof(cached)) != 0 || cached[0] == '\0')
+            strncpy(cached, "openwrt", sizeof(cached) - 1);
+        cached[sizeof(cached) - 1] = '\0';
+        initialized = 1;
+    }
+    return cached;
+}
+
+static size_t format_old(const struct sample *s, char *payload, size_t size)
+{
+    char persona_buf[32];
+    char priority_buf[16];
+    char policy_buf[32];
+    char dscp_buf[16];
+
+    strncpy(persona_buf, s->res.persona, sizeof(persona_buf) - 1);
+    persona_buf[sizeof(persona_buf) - 1] = '\0';
+    strncpy(priority_buf, s->res.priority, sizeof(priority_buf) - 1);
+    priority_buf[sizeof(priority_buf) - 1] = '\0';
+    strncpy(policy_buf, s->res.policy_action, sizeof(policy_buf) - 1);
+    policy_buf[sizeof(policy_buf) - 1] = '\0';
+    strncpy(dscp_buf, s->res.dscp, sizeof(dscp_buf) - 1);
+    dscp_buf[sizeof(dscp_buf) - 1] = '\0';
+
+    char ts[32];
+    iso8601_now(ts, sizeof(ts));
+
+    char src_esc[128];
+    char dst_esc[128];
+    char proto_esc[32];
+    char category_esc[32];
+    char priority_esc[32];
+    char router_esc[64];
+    char hostname_esc[128];
+    char service_esc[128];
+    char dns_esc[128];
+    char policy_esc[64];
+    char dscp_esc[32];
+    char app_esc[128];
+
+    json_escape(s->src, src_esc, sizeof(src_esc));
+    json_escape(s->dst, dst_esc, sizeof(dst_esc));
+    json_escape(s->proto, proto_esc, sizeof(proto_esc));
+    json_escape(persona_buf, category_esc, sizeof(category_esc));
+    json_escape(priority_buf, priority_esc, sizeof(priority_esc));
+    json_escape(router_id(), router_esc, sizeof(router_esc));
+    json_escape(s->hostname, hostname_esc, sizeof(hostname_esc));
+    json_escape(s->service_hint, service_esc, sizeof(service_esc));
+    json_escape(s->dns_name, dns_esc, sizeof(dns_esc));
+    json_escape(policy_buf, policy_esc, sizeof(policy_esc));
+    json_escape(dscp_buf, dscp_esc, sizeof(dscp_esc));
+    json_escape(s->app_hint, app_esc, sizeof(app_esc));
+
+    int n = snprintf(payload, size,
+             "{\"event\":\"qosd_classify\",\"timestamp\":\"%s\",\"src\":\"%s\","
+             "\"dst\":\"%s\",\"proto\":\"%s\",\"category\":\"%s\",\"priority\":\"%s\","
+             "\"router\":\"%s\",\"src_port\":%u,\"dst_port\":%u,\"hostname\":\"%s\","
+             "\"service_hint\":\"%s\",\"dns_name\":\"%s\",\"policy_action\":\"%s\","
+             "\"dscp\":\"%s\",\"confidence\":%u,\"bytes_total\":%llu,\"latency_ms\":%u,"
+             "\"app_hint\":\"%s\"}",
+             ts, src_esc, dst_esc, proto_esc, category_esc, priority_esc,
+             router_esc, s->src_port, s->dst_port, hostname_esc, service_esc, dns_esc,
+             policy_esc, dscp_esc, s->res.confidence,
+             (unsigned long long)s->bytes_total, s->latency_ms, app_esc);
+    return n < 0 ? 0 : strlen(payload);
+}
+
+/* ---- current implementation, field for field as in qosd_telemetry.c ---- */
+
+static size_t format_new(struct json_writer *w, const struct sample *s, const char **out)
+{
+    json_begin(w);
+    json_add_string(w, "event", "qosd_classify");
+    json_add_string(w, "timestamp", qosd_timestamp_now());
+    json_add_string(w, "src", s->src);
+    json_add_string(w, "dst", s->dst);
+    json_add_string(w, "proto", s->proto);
+    json_add_string(w, "category", s->res.persona);
+    json_add_string(w, "priority", s->res.priority);
+    json_add_string(w, "router", qosd_router_id());
+    json_add_u64(w, "src_port", s->src_port);
+    json_add_u64(w, "dst_port", s->dst_port);
+    json_add_string(w, "hostname", s->hostname);
+    json_add_string(w, "service_hint", s->service_hint);
+    json_add_string(w, "dns_name", s->dns_name);
+    json_add_string(w, "policy_action", s->res.policy_action);
+    json_add_string(w, "dscp", s->res.dscp);
+    json_add_u64(w, "confidence", s->res.confidence);
+    json_add_u64(w, "bytes_total", s->bytes_total);
+    json_add_u64(w, "latency_ms", s->latency_ms);
+    json_add_string(w, "app_hint", s->app_hint);
+
+    *out = json_end(w);
+    return *out ? w->len : 0;
+}
+
+/* Blanks the timestamp value, which differs when a second ticks between the two */
+static void mask_timestamp(char *json)
+{
+    char *p = strstr(json, "\"timestamp\":\"");
+    if (!p)
+        return;
+    for (p += strlen("\"timestamp\":\""); *p && *p != '"'; p++)
+        *p = '*';
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned events = argc > 1 ? (unsigned)strtoul(argv[1], NULL, 10) : 1000000;
+    struct json_writer jw = {0};
+    char payload[768], old_cmp[768], new_cmp[768];
+    int ret = 0;
+
+    printf("%-8s %6s %6s %12s %12s %7s\n", "sample", "old_b", "new_b", "old_ev/s", "new_ev/s", "speedup");
+
+    for (size_t i = 0; i < sizeof(g_samples) / sizeof(g_samples[0]); i++) {
+        const struct sample *s = &g_samples[i];
+        const char *out;
+        size_t old_len = format_old(s, payload, sizeof(payload));
+        size_t new_len = format_new(&jw, s, &out);
+
+        snprintf(old_cmp, sizeof(old_cmp), "%s", payload);
+        snprintf(new_cmp, sizeof(new_cmp), "%s", out ? out : "");
+        mask_timestamp(old_cmp);
+        mask_timestamp(new_cmp);
+        if (!s->truncated_before && (old_len != new_len || strcmp(old_cmp, new_cmp))) {
+            fprintf(stderr, "%s: output differs\n old %s\n new %s\n", s->name, payload, out);
+            ret = 1;
+        }
+
+        volatile size_t sink = 0;
+        uint64_t t0 = now_ns();
+        for (unsigned n = 0; n < events; n++)
+            sink += format_old(s, payload, sizeof(payload));
+        uint64_t t1 = now_ns();
+        for (unsigned n = 0; n < events; n++)
+            sink += format_new(&jw, s, &out);
+        uint64_t t2 = now_ns();
+        (void)sink;
+
+        double old_rate = events * 1e9 / (double)(t1 - t0);
+        double new_rate = events * 1e9 / (double)(t2 - t1);
+        printf("%-8s %6zu %6zu %12.0f %12.0f %6.2fx\n",
+               s->name, old_len, new_len, old_rate, new_rate, new_rate / old_rate);
+    }
+
+    json_free(&jw);
+    return ret;
+}
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#include "qosd.h"
+
+/*
+ * qosd_classify telemetry driven on a virtual clock, with syslog()
+ * replaced by a counter (linked with -Wl,--wrap=syslog) and the flush
+ * timer replaced by calling flush() every window. Reports events/s for
+ * plain logging, aggregation and the per-source limiter, how much a spray
+ * of sources gets through the limiter, and checks that long values are
+ * neither merged nor cut.
+ *
+ * usage: telemetry_bench [events]
+ */
+
+#include "../src/qosd_telemetry.c"
+
+static uint64_t g_now_us = 1000000;
+static uint64_t g_lines;
+static uint64_t g_suppressed_lines;
+static const char *g_expect;
+static uint64_t g_expect_found;
+
+uint64_t qosd_monotonic_usec(void)
+{
+    return g_now_us;
+}
+
+void __wrap_syslog(int prio, const char *fmt, ...)
+{
+    static char line[8192];
+    va_list ap;
+
+    (void)prio;
+    va_start(ap, fmt);
+    vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+
+    g_lines++;
+    if (strstr(line, "\"qosd_classify_suppressed\""))
+        g_suppressed_lines++;
+    if (g_expect && strstr(line, g_expect))
+        g_expect_found++;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static struct persona_result g_res = { "streaming", "medium", "boost", "AF41", 80 };
+
+static void classify(const char *src, const char *dst, uint16_t dport, const char *dns)
+{
+    struct classify_event ev = {
+        .src = src,
+        .dst = dst,
+        .proto = "tcp",
+        .src_port = 50000,
+        .dst_port = dport,
+        .hostname = "pixel-7",
+        .service_hint = "",
+        .dns_name = dns,
+        .app_hint = "",
+        .bytes_total = 123456,
+        .latency_ms = 20,
+        .res = &g_res,
+    };
+    qosd_telemetry_classify(&ev);
+}
+
+/*
+ * Cycles through `groups` flows spread over `sources` sources, or gives
+ * every event a flow of its own with groups 0, at event_hz virtual events
+ * per second.
+ */
+static void run(const char *name, unsigned window, unsigned rate, unsigned burst,
+                unsigned events, unsigned sources, unsigned groups, unsigned event_hz)
+{
+    unsigned period_us = (window ? window : SUPPRESS_REPORT_S) * 1000000;
+    uint64_t next_flush = g_now_us + period_us;
+    char src[64], dst[64];
+
+    qosd_telemetry_init(window, rate, burst);
+    g_lines = g_suppressed_lines = 0;
+
+    uint64_t t0 = now_ns();
+    for (unsigned n = 0; n < events; n++) {
+        unsigned g = groups ? n % groups : n;
+        unsigned s = n % sources;
+        snprintf(src, sizeof(src), "192.168.%u.%u", 1 + s / 250, 1 + s % 250);
+        snprintf(dst, sizeof(dst), "10.%u.%u.%u", g >> 16 & 0xff, g >> 8 & 0xff, g & 0xff);
+        classify(src, dst, 443, "rr3---sn-4g5e6nzl.googlevideo.com");
+
+        g_now_us += 1000000 / event_hz;
+        if (g_now_us >= next_flush) {
+            flush();
+            next_flush += period_us;
+        }
+    }
+    uint64_t t1 = now_ns();
+
+    qosd_telemetry_done();
+    printf("%-10s %10u %12.0f %10llu %10llu\n", name, events, events * 1e9 / (double)(t1 - t0),
+           (unsigned long long)(g_lines - g_suppressed_lines),
+           (unsigned long long)g_suppressed_lines);
+}
+
+static int check_long_values(void)
+{
+    char a[128], b[128], dns[320];
+    int ret = 0;
+
+    /* Two sources that only differ after 64 characters are two groups */
+    memset(a, 'a', sizeof(a) - 1);
+    a[sizeof(a) - 1] = '\0';
+    memcpy(b, a, sizeof(b));
+    b[100] = 'b';
+
+    memset(dns, 'd', sizeof(dns) - 1);
+    dns[sizeof(dns) - 1] = '\0';
+
+    qosd_telemetry_init(60, 0, 0);
+    g_lines = 0;
+    g_expect = dns;
+    g_expect_found = 0;
+    for (int i = 0; i < 10; i++) {
+        classify(a, "10.0.0.1", 443, dns);
+        classify(b, "10.0.0.1", 443, dns);
+    }
+    qosd_telemetry_done();
+    g_expect = NULL;
+
+    if (g_lines != 2) {
+        fprintf(stderr, "long sources: %llu groups logged, want 2\n", (unsigned long long)g_lines);
+        ret = 1;
+    }
+    if (g_expect_found != 2) {
+        fprintf(stderr, "long dns_name: %llu of 2 groups carry it uncut\n", (unsigned long long)g_expect_found);
+        ret = 1;
+    }
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned events = argc > 1 ? (unsigned)strtoul(argv[1], NULL, 10) : 1000000;
+
+    printf("%-10s %10s %12s %10s %10s\n", "case", "events", "events/s", "logged", "supp_ev");
+
+    /* Every event logged */
+    run("plain", 0, 0, 0, events, 50, 64, 1000);
+    /* 150 groups folded into one line each per 10 s window */
+    run("aggregate", 10, 0, 0, events, 50, 150, 1000);
+    /* The same with a 10/s per source limit they stay well within */
+    run("limited", 10, 10, 20, events, 50, 150, 1000);
+    /* 1000 sources opening 20000 new groups per second, limited to 10/s each */
+    run("spray", 10, 10, 20, events, 1000, 0, 20000);
+
+    return check_long_values();
+}
@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "qosd.h"
+
+/*
+ * qosd_flows and qosd_topk fed synthetic conntrack passes on a virtual
+ * clock, next to exact counting: a full per-flow table of previous byte
+ * counts and a per-key total for every dimension. Reports the bytes each
+ * side counted, the live flows the fixed-size table evicted, and for the
+ * top 8 talkers how many both sides agree on, the worst error of the
+ * reported `bytes`, the widest reported `error` and how many exact totals
+ * fall outside [bytes - error, bytes]. Entries/s cover both steps.
+ *
+ * usage: topk_bench [passes]
+ */
+
+#include "../src/qosd_flows.c"
+#include "../src/qosd_topk.c"
+
+#define TALKERS 64
+
+static uint64_t g_now_us = 1000000;
+
+struct qosd_counters qosd_stats;
+
+uint64_t qosd_monotonic_usec(void)
+{
+    return g_now_us;
+}
+
+bool qosd_live_refresh(void)
+{
+    return false;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* ---- exact counting ---- */
+
+struct exact_slot {
+    char *key;
+    uint64_t value;
+};
+
+struct exact_map {
+    struct exact_slot *slots;
+    size_t size;
+    size_t used;
+};
+
+static uint64_t *exact_get(struct exact_map *m, const char *key)
+{
+    if (2 * (m->used + 1) > m->size) {
+        struct exact_map g = { calloc(m->size ? 2 * m->size : 1024, sizeof(*g.slots)),
+                               m->size ? 2 * m->size : 1024, 0 };
+        for (size_t i = 0; i < m->size; i++) {
+            if (!m->slots[i].key)
+                continue;
+            size_t j = hash_key(m->slots[i].key) & (g.size - 1);
+            while (g.slots[j].key)
+                j = (j + 1) & (g.size - 1);
+            g.slots[j] = m->slots[i];
+            g.used++;
+        }
+        free(m->slots);
+        *m = g;
+    }
+
+    size_t i = hash_key(key) & (m->size - 1);
+    while (m->slots[i].key) {
+        if (!strcmp(m->slots[i].key, key))
+            return &m->slots[i].value;
+        i = (i + 1) & (m->size - 1);
+    }
+    m->slots[i].key = strdup(key);
+    m->used++;
+    return &m->slots[i].value;
+}
+
+static void exact_free(struct exact_map *m)
+{
+    for (size_t i = 0; i < m->size; i++)
+        free(m->slots[i].key);
+    free(m->slots);
+    memset(m, 0, sizeof(*m));
+}
+
+static struct exact_map g_exact_flows;
+static struct exact_map g_exact_dims[__TOPK_DIM_MAX];
+static bool g_exact_primed;
+
+static void exact_add(int dim, const char *key, uint64_t bytes)
+{
+    *exact_get(&g_exact_dims[dim], key) += bytes;
+}
+
+/* Bytes since the previous pass, counting new flows in full */
+static uint64_t exact_account(const struct nfct_entry *e)
+{
+    char key[TOPK_KEY_LEN + 32];
+
+    snprintf(key, sizeof(key), "%s %s %u %s %u", e->proto, e->src, e->sport, e->dst, e->dport);
+    uint64_t *prev = exact_get(&g_exact_flows, key);
+    uint64_t bytes = e->orig_bytes + e->reply_bytes;
+    uint64_t delta = bytes - *prev;
+    *prev = bytes;
+    if (!g_exact_primed || !delta)
+        return 0;
+
+    exact_add(TOPK_TALKERS, e->src, delta);
+    exact_add(TOPK_DESTINATIONS, e->dst, delta);
+    snprintf(key, sizeof(key), "%s>%s", e->src, e->dst);
+    exact_add(TOPK_PAIRS, key, delta);
+    snprintf(key, sizeof(key), "%s/%u", e->proto, e->dport);
+    exact_add(TOPK_PORTS, key, delta);
+    return delta;
+}
+
+/* ---- workload ---- */
+
+struct flow {
+    uint32_t id;
+    uint64_t bytes;
+    uint32_t rate;    /* Bytes per pass, 0 for idle flows */
+};
+
+static uint32_t g_rng = 2463534242u;
+
+static uint32_t rnd(void)
+{
+    g_rng ^= g_rng << 13;
+    g_rng ^= g_rng >> 17;
+    g_rng ^= g_rng << 5;
+    return g_rng;
+}
+
+static uint32_t g_next_id;
+
+static void flow_new(struct flow *f, unsigned active_pct, uint64_t history)
+{
+    f->id = g_next_id++;
+    f->bytes = history ? history + rnd() % history : 0;
+    f->rate = rnd() % 100 < active_pct ? 1000 + rnd() % 200000 : 0;
+    /* A few talkers carry most of the traffic */
+    if (f->rate && f->id % 50 == 0)
+        f->rate *= 20;
+}
+
+static void flow_entry(const struct flow *f, struct nfct_entry *e)
+{
+    uint32_t id = f->id;
+    /* Heavy flows (id % 50 == 0) sit on the first few talkers */
+    unsigned talker = id % 50 == 0 ? (id / 50) % 8 : id % TALKERS;
+
+    strcpy(e->proto, id % 5 ? "tcp" : "udp");
+    snprintf(e->src, sizeof(e->src), "192.168.1.%u", 1 + talker);
+    snprintf(e->dst, sizeof(e->dst), "%u.%u.%u.%u", 20 + (id >> 16) % 200, (id >> 8) & 0xff, id & 0xff, 1 + id % 7);
+    e->sport = (uint16_t)(1024 + id % 60000);
+    e->dport = id % 3 ? 443 : 80;
+    e->orig_bytes = f->bytes / 4;
+    e->reply_bytes = f->bytes - f->bytes / 4;
+}
+
+struct result {
+    uint64_t topk_bytes;
+    uint64_t exact_bytes;
+    uint64_t topk_ns;
+    uint64_t exact_ns;
+    uint64_t entries;
+    uint64_t evictions;
+};
+
+/*
+ * `flows` conntrack entries, `active_pct` percent of them moving data and
+ * `churn_pct` percent replaced by new flows every pass. Idle flows carry
+ * up to `history` bytes from before the first pass.
+ */
+static void run(const char *name, unsigned conntrack_max, unsigned flows, unsigned active_pct,
+                unsigned churn_pct, uint64_t history, unsigned passes)
+{
+    struct flow *f = calloc(flows, sizeof(*f));
+    struct nfct_entry e;
+    struct result r = {0};
+
+    g_rng = 2463534242u;
+    g_next_id = 0;
+    for (unsigned i = 0; i < flows; i++)
+        flow_new(&f[i], active_pct, history);
+
+    qosd_topk_init(3600);
+    flows_alloc(conntrack_max);
+    qosd_stats.flow_evictions = 0;
+    g_exact_primed = false;
+
+    for (unsigned p = 0; p < passes; p++) {
+        for (unsigned i = 0; p && i < flows; i++) {
+            if (rnd() % 1000 < churn_pct * 10)
+                flow_new(&f[i], active_pct, 0);
+            f[i].bytes += f[i].rate;
+        }
+
+        uint64_t t0 = now_ns();
+        for (unsigned i = 0; i < flows; i++) {
+            uint64_t d_orig, d_reply;
+            flow_entry(&f[i], &e);
+            qosd_flows_delta(&e, &d_orig, &d_reply);
+            qosd_topk_account(NULL, &e, d_orig + d_reply);
+        }
+        qosd_topk_commit(NULL);
+        qosd_flows_pass_end();
+        uint64_t t1 = now_ns();
+        for (unsigned i = 0; i < flows; i++) {
+            flow_entry(&f[i], &e);
+            r.exact_bytes += exact_account(&e);
+        }
+        g_exact_primed = true;
+        uint64_t t2 = now_ns();
+
+        /* flow_entry() runs on both sides; time them alike */
+        r.topk_ns += t1 - t0;
+        r.exact_ns += t2 - t1;
+        r.entries += flows;
+        g_now_us += 5000000;
+    }
+
+    /* Every byte counted lands in each Count-Min row exactly once */
+    advance();
+    for (unsigned s = 0; s < TOPK_SLOTS; s++) {
+        for (unsigned i = 0; i < TOPK_CMS_WIDTH; i++)
+            r.topk_bytes += g_slots[s].sk.cms[TOPK_TALKERS][0][i];
+    }
+    unsigned n = collect_top(TOPK_TALKERS, TOPK_SLOTS, g_cand);
+
+    /* Top 8 exact talkers: agreement, errors and bound violations */
+    struct topk_candidate exact[TALKERS];
+    unsigned ne = 0;
+    struct exact_map *m = &g_exact_dims[TOPK_TALKERS];
+    for (size_t i = 0; i < m->size; i++) {
+        if (m->slots[i].key) {
+            exact[ne].key = m->slots[i].key;
+            exact[ne].bytes = m->slots[i].value;
+            ne++;
+        }
+    }
+    qsort(exact, ne, sizeof(exact[0]), cmp_candidate);
+
+    unsigned top = ne < 8 ? ne : 8, hits = 0, outside = 0;
+    double worst = 0, widest = 0;
+    for (unsigned i = 0; i < top; i++) {
+        uint64_t bytes, error;
+        estimate(TOPK_TALKERS, exact[i].key, hash_key(exact[i].key), TOPK_SLOTS, &bytes, &error);
+        if (exact[i].bytes > bytes || exact[i].bytes < bytes - error)
+            outside++;
+        if (exact[i].bytes) {
+            double err = ((double)bytes - (double)exact[i].bytes) / (double)exact[i].bytes;
+            if (err < 0)
+                err = -err;
+            if (err > worst)
+                worst = err;
+            if ((double)error / (double)exact[i].bytes > widest)
+                widest = (double)error / (double)exact[i].bytes;
+        }
+        for (unsigned k = 0; k < n && k < top; k++) {
+            if (!strcmp(g_cand[k].key, exact[i].key))
+                hits++;
+        }
+    }
+
+    printf("%-9s %7u %7u %9llu %14llu %14llu %6u/%u %8.2f%% %8.2f%% %7u %11.0f %11.0f %8zu %8zu\n",
+           name, flows, (g_mask + 1) * FLOWS_WAYS, (unsigned long long)qosd_stats.flow_evictions,
+           (unsigned long long)r.topk_bytes, (unsigned long long)r.exact_bytes,
+           hits, top, worst * 100, widest * 100, outside,
+           r.entries * 1e9 / (double)r.topk_ns, r.entries * 1e9 / (double)r.exact_ns,
+           (size_t)(g_mask + 1) * sizeof(*g_buckets) / 1024,
+           (g_exact_flows.size * sizeof(struct exact_slot) + g_exact_flows.used * 48) / 1024);
+
+    qosd_topk_done();
+    qosd_flows_done();
+    exact_free(&g_exact_flows);
+    for (int d = 0; d < __TOPK_DIM_MAX; d++)
+        exact_free(&g_exact_dims[d]);
+    free(f);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned passes = argc > 1 ? (unsigned)strtoul(argv[1], NULL, 10) : 20;
+
+    printf("%-9s %7s %7s %9s %14s %14s %8s %9s %9s %7s %11s %11s %8s %8s\n",
+           "case", "flows", "ways", "evicted", "topk_bytes", "exact_bytes", "top8", "top8_err",
+           "top8_bnd", "outside", "topk_ent/s", "exact_ent/s", "flows_kb", "exact_kb");
+
+    /* Idle flows only: nothing moved, nothing may be counted */
+    run("idle", 262144, 200000, 0, 0, 1ULL << 30, passes);
+    /* The same beyond the table cap, e.g. nf_conntrack_max raised to 512k */
+    run("idle-cap", 524288, 500000, 0, 0, 1ULL << 30, passes);
+    /* A busy home router: 16k flows, a fifth of them active, 5% churn */
+    run("home", 16384, 12000, 20, 5, 1ULL << 24, passes);
+    /* nf_conntrack_max 65536 and full: four ways per flow, the table's cap */
+    run("full", 65536, 65536, 5, 2, 1ULL << 30, passes);
+    /* 200k flows with 1000-odd active ones, past the cap: 1.3 ways per flow */
+    run("mixed", 262144, 200000, 1, 2, 1ULL << 30, passes);
+    /* The same with a table sized for the default, thrashing */
+    run("starved", 16384, 200000, 1, 2, 1ULL << 30, passes);
+
+    return 0;
+}
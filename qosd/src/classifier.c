@@ -14,6 +14,34 @@ struct persona_profile {
     uint8_t confidence;
 };
 
+static const struct policy_overlay *g_overlay;
+
+const struct policy_overlay *classifier_set_overlay(const struct policy_overlay *overlay)
+{
+    return __atomic_exchange_n(&g_overlay, overlay, __ATOMIC_ACQ_REL);
+}
+
+static void apply_overlay(struct persona_profile *profile)
+{
+    const struct policy_overlay *overlay = __atomic_load_n(&g_overlay, __ATOMIC_ACQUIRE);
+    if (!overlay)
+        return;
+
+    for (unsigned i = 0; i < overlay->count; i++) {
+        const struct persona_policy *p = &overlay->entries[i];
+        if (strcmp(p->persona, profile->persona) != 0)
+            continue;
+
+        if (p->priority[0])
+            profile->priority = p->priority;
+        if (p->policy_action[0])
+            profile->policy_action = p->policy_action;
+        if (p->dscp[0])
+            profile->dscp = p->dscp;
+        return;
+    }
+}
+
 static void apply_profile(struct persona_result *res, const struct persona_profile *profile)
 {
     if (!res || !profile)
@@ -188,6 +216,8 @@ void classify_persona(const struct persona_request *req, struct persona_result *
         };
     }
 
+    apply_overlay(&profile);
+
     /* Refine confidence with latency hints */
     if (latency_ms > 150 && profile.confidence < 95 &&
         (strcmp(profile.policy_action, "boost") == 0)) {
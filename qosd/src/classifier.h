@@ -23,3 +23,20 @@ struct persona_result {
 };
 
 void classify_persona(const struct persona_request *req, struct persona_result *res);
+
+/* Per-persona override of the built-in priority/action/DSCP; empty keeps the built-in value */
+struct persona_policy {
+    char persona[32];
+    char priority[16];
+    char policy_action[32];
+    char dscp[16];
+};
+
+/* Immutable once published; replaced as a whole, never edited in place */
+struct policy_overlay {
+    unsigned count;
+    struct persona_policy entries[];
+};
+
+/* Returns the previous overlay; NULL restores the built-in profiles */
+const struct policy_overlay *classifier_set_overlay(const struct policy_overlay *overlay);
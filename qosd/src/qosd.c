@@ -9,11 +9,12 @@
 #include <string.h>
 
 #include "classifier.h"
+#include "qosd.h"
 
 static struct ubus_context *ctx;
 static struct blob_buf bb;
 
-void qosd_live_method_init(struct ubus_method *method);
+struct qosd_counters qosd_stats;
 
 enum {
     CL_SRC,
@@ -44,52 +45,6 @@ static const struct blobmsg_policy classify_policy[__CL_MAX] = {
     [CL_LATENCY]  = { .name = "latency_ms", .type = BLOBMSG_TYPE_INT32 },
 };
 
-static void iso8601_now(char *buf, size_t len)
-{
-    time_t now = time(NULL);
-    struct tm tm;
-    if (!gmtime_r(&now, &tm))
-        memset(&tm, 0, sizeof(tm));
-    strftime(buf, len, "%Y-%m-%dT%H:%M:%SZ", &tm);
-}
-
-static void json_escape(const char *in, char *out, size_t out_len)
-{
-    size_t oi = 0;
-    for (size_t i = 0; in && in[i] && oi + 1 < out_len; i++) {
-        unsigned char c = (unsigned char)in[i];
-        if (c == '"' || c == '\\') {
-            if (oi + 2 >= out_len)
-                break;
-            out[oi++] = '\\';
-            out[oi++] = c;
-        } else if (c <= 0x1F) {
-            if (oi + 6 >= out_len)
-                break;
-            int written = snprintf(out + oi, out_len - oi, "\\u%04x", c);
-            if (written < 0)
-                break;
-            oi += (size_t)written;
-        } else {
-            out[oi++] = c;
-        }
-    }
-    out[oi] = '\0';
-}
-
-static const char *router_id(void)
-{
-    static char cached[64] = {0};
-    static int initialized = 0;
-    if (!initialized) {
-        if (gethostname(cached, sizeof(cached)) != 0 || cached[0] == '\0')
-            strncpy(cached, "openwrt", sizeof(cached) - 1);
-        cached[sizeof(cached) - 1] = '\0';
-        initialized = 1;
-    }
-    return cached;
-}
-
 static int
 qosd_classify(struct ubus_context *ctx, struct ubus_object *obj,
               struct ubus_request_data *ureq, const char *method,
@@ -97,6 +52,7 @@ qosd_classify(struct ubus_context *ctx, struct ubus_object *obj,
 {
     struct blob_attr *tb[__CL_MAX];
     blobmsg_parse(classify_policy, __CL_MAX, tb, blob_data(msg), blob_len(msg));
+    qosd_stats.classify_calls++;
 
     const char *src   = tb[CL_SRC]   ? blobmsg_get_string(tb[CL_SRC])   : "unknown";
     const char *dst   = tb[CL_DST]   ? blobmsg_get_string(tb[CL_DST])   : "unknown";
@@ -108,7 +64,7 @@ qosd_classify(struct ubus_context *ctx, struct ubus_object *obj,
     const char *dns_name = tb[CL_DNS] ? blobmsg_get_string(tb[CL_DNS]) : "";
     const char *app_hint = tb[CL_APP] ? blobmsg_get_string(tb[CL_APP]) : "";
     uint64_t bytes_total = tb[CL_BYTES] ? blobmsg_get_u64(tb[CL_BYTES]) : 0;
-    uint32_t latency_ms = tb[CL_LATENCY] ? blobmsg_get_u32(tb[CL_LATENCY]) : 0;
+    uint32_t latency_ms = tb[CL_LATENCY] ? blobmsg_get_u32(tb[CL_LATENCY]) : qosd_probe_path_ms(src, dst);
 
     char persona_buf[32];
     char priority_buf[16];
@@ -150,60 +106,35 @@ qosd_classify(struct ubus_context *ctx, struct ubus_object *obj,
     blobmsg_add_u32(&bb, "confidence", pres.confidence);
     blobmsg_close_table(&bb, t);
 
-    char ts[32];
-    iso8601_now(ts, sizeof(ts));
-
-    char src_esc[128];
-    char dst_esc[128];
-    char proto_esc[32];
-    char category_esc[32];
-    char priority_esc[32];
-    char router_esc[64];
-    char hostname_esc[128];
-    char service_esc[128];
-    char dns_esc[128];
-    char policy_esc[64];
-    char dscp_esc[32];
-    char app_esc[128];
-
-    json_escape(src, src_esc, sizeof(src_esc));
-    json_escape(dst, dst_esc, sizeof(dst_esc));
-    json_escape(proto, proto_esc, sizeof(proto_esc));
-    json_escape(persona_buf, category_esc, sizeof(category_esc));
-    json_escape(priority_buf, priority_esc, sizeof(priority_esc));
-    json_escape(router_id(), router_esc, sizeof(router_esc));
-    json_escape(hostname, hostname_esc, sizeof(hostname_esc));
-    json_escape(service_hint, service_esc, sizeof(service_esc));
-    json_escape(dns_name, dns_esc, sizeof(dns_esc));
-    json_escape(policy_buf, policy_esc, sizeof(policy_esc));
-    json_escape(dscp_buf, dscp_esc, sizeof(dscp_esc));
-    json_escape(app_hint, app_esc, sizeof(app_esc));
-
-    char payload[768];
-    snprintf(payload, sizeof(payload),
-             "{\"event\":\"qosd_classify\",\"timestamp\":\"%s\",\"src\":\"%s\","
-             "\"dst\":\"%s\",\"proto\":\"%s\",\"category\":\"%s\",\"priority\":\"%s\","
-             "\"router\":\"%s\",\"src_port\":%u,\"dst_port\":%u,\"hostname\":\"%s\","
-             "\"service_hint\":\"%s\",\"dns_name\":\"%s\",\"policy_action\":\"%s\","
-             "\"dscp\":\"%s\",\"confidence\":%u,\"bytes_total\":%llu,\"latency_ms\":%u,"
-             "\"app_hint\":\"%s\"}",
-             ts, src_esc, dst_esc, proto_esc, category_esc, priority_esc,
-             router_esc, src_port, dst_port, hostname_esc, service_esc, dns_esc,
-             policy_esc, dscp_esc, pres.confidence,
-             (unsigned long long)bytes_total, latency_ms, app_esc);
-    syslog(LOG_INFO, "%s", payload);
+    struct classify_event ev = {
+        .src = src,
+        .dst = dst,
+        .proto = proto,
+        .src_port = src_port,
+        .dst_port = dst_port,
+        .hostname = hostname,
+        .service_hint = service_hint,
+        .dns_name = dns_name,
+        .app_hint = app_hint,
+        .bytes_total = bytes_total,
+        .latency_ms = latency_ms,
+        .res = &pres,
+    };
+    qosd_telemetry_classify(&ev);
 
     ubus_send_reply(ctx, ureq, bb.head);
     return 0;
 }
 
-static struct ubus_method qosd_methods[2];
+static struct ubus_method qosd_methods[4];
 
 static void
 qosd_methods_init(void)
 {
     qosd_methods[0] = (struct ubus_method)UBUS_METHOD("classify", qosd_classify, classify_policy);
     qosd_live_method_init(&qosd_methods[1]);
+    qosd_history_method_init(&qosd_methods[2]);
+    qosd_topk_method_init(&qosd_methods[3]);
 }
 
 static struct ubus_object_type qosd_obj_type =
@@ -216,9 +147,175 @@ static struct ubus_object qosd_obj = {
     .n_methods = ARRAY_SIZE(qosd_methods),
 };
 
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -m [addr:]port   Serve OpenMetrics on http://addr:port/metrics\n"
+            "  -w <threads>     Parse conntrack on a pool of worker threads\n"
+            "  -s <file>        Restore/save the host table snapshot in <file>\n"
+            "  -S <seconds>     Snapshot interval (default 60, 0 = on exit only)\n"
+            "  -a <seconds>     Aggregate classify events per window (0 = log each)\n"
+            "  -r <rate>[/<burst>]  Distinct classify events per second per source\n"
+            "  -H <hosts>       Keep rate history for up to <hosts> hosts\n"
+            "  -n <samples>     Raw history samples per host (default 180)\n"
+            "  -i <seconds>     Sample interval for history, -M and -C (default 10)\n"
+            "  -p <url>         Poll persona policies from http://<ip>[:port]/path\n"
+            "  -P <seconds>     Policy poll interval (default 300)\n"
+            "  -t <seconds>     Track top talkers/destinations/ports over a window\n"
+            "  -R <seconds>[/<budget>]  Probe host RTT, at most <budget> pings per round\n"
+            "  -M <name>        Publish the host table in shared memory <name> (e.g. /qosd)\n"
+            "  -N/-L/-A <file>  Read conntrack/leases/ARP from <file>\n"
+            "  -C <file>        Record snapshots every -i seconds into <file>, no ubus\n"
+            "  -c <count>       Stop recording after <count> snapshots\n"
+            "  -X <file>        Replay recorded snapshots through the pipeline, no ubus\n"
+            "  -x <speed>       Replay speed, 1-1000 times recorded pace (default 1)\n"
+            "  -o <file>        Write per-interval replay output to <file>\n"
+            "  -b <file>        Compare replay output with an earlier -o <file>\n",
+            prog);
+}
+
 int main(int argc, char **argv)
 {
+    const char *metrics_listen = NULL;
+    unsigned ingest_threads = 0;
+    const char *state_file = NULL;
+    unsigned state_interval = 60;
+    unsigned classify_window = 0;
+    unsigned classify_rate = 0;
+    unsigned classify_burst = 0;
+    unsigned history_hosts = 0;
+    unsigned history_samples = 180;
+    unsigned sample_interval = 10;
+    const char *policy_url = NULL;
+    unsigned policy_interval = 300;
+    unsigned top_window = 0;
+    unsigned probe_interval = 0;
+    unsigned probe_budget = 32;
+    const char *shm_name = NULL;
+    const char *nfct_path = NULL;
+    const char *leases_path = NULL;
+    const char *arp_path = NULL;
+    const char *capture_file = NULL;
+    unsigned capture_count = 0;
+    const char *replay_file = NULL;
+    unsigned replay_speed = 1;
+    const char *replay_out = NULL;
+    const char *replay_baseline = NULL;
+    char *end;
+    int ch, ret;
+
+    while ((ch = getopt(argc, argv, "m:w:s:S:a:r:H:n:i:p:P:t:R:M:N:L:A:C:c:X:x:o:b:h")) != -1) {
+        switch (ch) {
+        case 'm':
+            metrics_listen = optarg;
+            break;
+        case 'w':
+            ingest_threads = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            state_file = optarg;
+            break;
+        case 'S':
+            state_interval = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        case 'a':
+            classify_window = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            classify_rate = (unsigned)strtoul(optarg, &end, 10);
+            if (*end == '/')
+                classify_burst = (unsigned)strtoul(end + 1, NULL, 10);
+            break;
+        case 'H':
+            history_hosts = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            history_samples = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        case 'i':
+            sample_interval = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            policy_url = optarg;
+            break;
+        case 'P':
+            policy_interval = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            top_window = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        case 'R':
+            probe_interval = (unsigned)strtoul(optarg, &end, 10);
+            if (*end == '/')
+                probe_budget = (unsigned)strtoul(end + 1, NULL, 10);
+            break;
+        case 'M':
+            shm_name = optarg;
+            break;
+        case 'N':
+            nfct_path = optarg;
+            break;
+        case 'L':
+            leases_path = optarg;
+            break;
+        case 'A':
+            arp_path = optarg;
+            break;
+        case 'C':
+            capture_file = optarg;
+            break;
+        case 'c':
+            capture_count = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        case 'X':
+            replay_file = optarg;
+            break;
+        case 'x':
+            replay_speed = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            replay_out = optarg;
+            break;
+        case 'b':
+            replay_baseline = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return ch == 'h' ? 0 : 1;
+        }
+    }
+
+    qosd_stats.start_time = time(NULL);
+    qosd_live_set_paths(nfct_path, leases_path, arp_path);
+
     uloop_init();
+
+    if (capture_file) {
+        ret = qosd_capture_run(capture_file, sample_interval, capture_count);
+        uloop_done();
+        return ret;
+    }
+
+    if (qosd_flows_init())
+        fprintf(stderr, "Failed to allocate the per-flow table, byte counters disabled\n");
+
+    /* Only the sampling pipeline takes part in a replay */
+    if (replay_file) {
+        if (qosd_topk_init(top_window))
+            fprintf(stderr, "Failed to allocate heavy-hitter sketches, disabled\n");
+        if (ingest_threads && qosd_ingest_init(ingest_threads))
+            fprintf(stderr, "Failed to start ingest workers, sampling inline\n");
+
+        ret = qosd_replay_run(replay_file, replay_speed, replay_out, replay_baseline);
+
+        qosd_ingest_done();
+        qosd_topk_done();
+        qosd_flows_done();
+        uloop_done();
+        return ret;
+    }
+
     ctx = ubus_connect(NULL);
     if (!ctx) {
         fprintf(stderr, "Failed to connect to ubus\n");
@@ -229,17 +326,56 @@ int main(int argc, char **argv)
 
     openlog("qosd", LOG_PID | LOG_NDELAY, LOG_DAEMON);
 
+    if (qosd_telemetry_init(classify_window, classify_rate, classify_burst))
+        fprintf(stderr, "Failed to allocate classify aggregation, logging each event\n");
+
+    if (state_file && qosd_state_init(state_file, state_interval))
+        fprintf(stderr, "Ignoring unusable snapshot %s\n", state_file);
+
     qosd_methods_init();
 
-    int ret = ubus_add_object(ctx, &qosd_obj);
+    ret = ubus_add_object(ctx, &qosd_obj);
     if (ret) {
         fprintf(stderr, "ubus_add_object failed: %d\n", ret);
         return 1;
     }
 
     printf("QoSD registered to ubus successfully!\n");
+
+    /* Before the ingest pool, which allocates per-thread accumulators */
+    if (qosd_topk_init(top_window))
+        fprintf(stderr, "Failed to allocate heavy-hitter sketches, disabled\n");
+
+    if (qosd_probe_init(probe_interval, probe_budget))
+        fprintf(stderr, "Failed to start RTT prober, disabled\n");
+
+    if (ingest_threads && qosd_ingest_init(ingest_threads))
+        fprintf(stderr, "Failed to start ingest workers, sampling inline\n");
+
+    if (qosd_history_init(history_hosts, history_samples, sample_interval))
+        fprintf(stderr, "Failed to allocate rate history, disabled\n");
+
+    if (shm_name && qosd_shm_init(shm_name, sample_interval))
+        fprintf(stderr, "Failed to publish shared memory %s\n", shm_name);
+
+    if (policy_url && qosd_policy_init(policy_url, policy_interval))
+        fprintf(stderr, "Ignoring invalid policy URL %s\n", policy_url);
+
+    if (metrics_listen && qosd_metrics_init(metrics_listen))
+        fprintf(stderr, "Failed to start metrics listener on %s\n", metrics_listen);
+
     uloop_run();
 
+    qosd_metrics_done();
+    qosd_history_done();
+    qosd_shm_done();
+    qosd_ingest_done();
+    qosd_policy_done();
+    qosd_probe_done();
+    qosd_topk_done();
+    qosd_flows_done();
+    qosd_state_done();
+    qosd_telemetry_done();
     ubus_free(ctx);
     uloop_done();
     return 0;
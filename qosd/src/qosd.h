@@ -0,0 +1,195 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <libubus.h>
+
+#include "classifier.h"
+
+#define MAX_HOSTS 1024
+
+/* Defaults, overridable with -N/-L/-A */
+#define LEASES_FILE "/tmp/dhcp.leases"
+#define ARP_FILE    "/proc/net/arp"
+#define NFCT_FILE   "/proc/net/nf_conntrack"
+
+struct host_stat {
+    char ip[64];
+    char mac[32];
+    char hostname[64];
+    char persona[32];
+    char priority[16];
+    char policy_action[32];
+    char dscp[16];
+    uint8_t confidence;
+
+    uint64_t cur_rx_bytes;    /* Moved since the previous pass, summed per flow */
+    uint64_t cur_tx_bytes;
+
+    uint64_t rx_bytes_total;  /* Monotonic, accumulated from the per-pass bytes */
+    uint64_t tx_bytes_total;
+
+    uint64_t rx_bps;
+    uint64_t tx_bps;
+
+    time_t last_seen;
+    bool used;
+};
+
+/* Daemon self-metrics, owned by qosd.c */
+struct qosd_counters {
+    time_t start_time;
+    uint64_t classify_calls;
+    uint64_t live_calls;
+    uint64_t samples;          /* Completed conntrack sampling passes */
+    uint64_t sample_usec;      /* Duration of the last pass */
+    uint64_t conntrack_lines;  /* Entries seen in the last pass */
+    uint64_t scrapes;          /* Metrics requests served */
+    uint64_t host_overflows;   /* Conntrack entry directions dropped, host table full */
+    uint64_t flow_evictions;   /* Live flows pushed out of the per-flow table */
+};
+
+extern struct qosd_counters qosd_stats;
+
+/* One parsed /proc/net/nf_conntrack line (original direction tuple) */
+struct nfct_entry {
+    char proto[16];
+    char src[64];
+    char dst[64];
+    uint16_t sport;
+    uint16_t dport;
+    uint64_t orig_bytes;
+    uint64_t reply_bytes;
+};
+
+/* Per-host partial aggregate produced by an ingest pass */
+struct ingest_host {
+    char ip[64];
+    const char *hostname;      /* Lease hostname, owned by the ingest pass */
+    uint64_t first;            /* Position of the first entry naming this host */
+    uint32_t entries;          /* Entry directions accounted to it */
+    bool known;                /* Already in the host table when the pass started */
+    uint64_t rx_bytes;
+    uint64_t tx_bytes;
+    struct persona_result res; /* Highest-confidence result seen */
+    bool used;
+};
+
+/* One classify call as logged by the telemetry module */
+struct classify_event {
+    const char *src;
+    const char *dst;
+    const char *proto;
+    uint16_t src_port;
+    uint16_t dst_port;
+    const char *hostname;
+    const char *service_hint;
+    const char *dns_name;
+    const char *app_hint;
+    uint64_t bytes_total;
+    uint32_t latency_ms;
+    const struct persona_result *res;
+};
+
+struct json_writer {
+    char *buf;
+    size_t len;
+    size_t cap;
+    bool first;   /* No field written yet, so no comma */
+    bool failed;  /* Allocation failed, event is dropped */
+};
+
+/* qosd_json.c */
+void json_begin(struct json_writer *w);
+void json_add_string(struct json_writer *w, const char *key, const char *val);
+void json_add_u64(struct json_writer *w, const char *key, uint64_t val);
+const char *json_end(struct json_writer *w);
+void json_free(struct json_writer *w);
+void qosd_iso8601(time_t ts, char *buf, size_t len);
+const char *qosd_timestamp_now(void);
+const char *qosd_router_id(void);
+
+/* qosd_live.c */
+void qosd_live_method_init(struct ubus_method *method);
+bool qosd_live_refresh(void);
+struct host_stat *qosd_live_hosts(void);
+uint64_t qosd_live_get_tick(void);
+void qosd_live_set_tick(uint64_t tick_ms);
+void qosd_live_set_paths(const char *nfct, const char *leases, const char *arp);
+const char *qosd_live_nfct_path(void);
+const char *qosd_live_leases_path(void);
+const char *qosd_live_arp_path(void);
+void qosd_live_set_clock(uint64_t usec);
+uint64_t qosd_monotonic_usec(void);
+bool nfct_parse_line(const char *line, struct nfct_entry *e);
+void nfct_classify(const struct nfct_entry *e, const char *hostname, struct persona_result *res);
+void qosd_live_ingest_complete(const struct ingest_host *hosts, unsigned n, uint64_t lines);
+
+/* qosd_ingest.c */
+int qosd_ingest_init(unsigned threads);
+void qosd_ingest_done(void);
+bool qosd_ingest_enabled(void);
+bool qosd_ingest_busy(void);
+int qosd_ingest_start(const struct host_stat *hosts);
+
+/* qosd_state.c */
+int qosd_state_init(const char *path, unsigned interval);
+int qosd_state_save(void);
+void qosd_state_done(void);
+
+/* qosd_metrics.c */
+int qosd_metrics_init(const char *listen);
+void qosd_metrics_done(void);
+
+/* qosd_history.c */
+int qosd_history_init(unsigned hosts, unsigned samples, unsigned interval);
+void qosd_history_record(const struct host_stat *hosts);
+void qosd_history_method_init(struct ubus_method *method);
+void qosd_history_done(void);
+
+/* qosd_policy.c */
+int qosd_policy_init(const char *url, unsigned interval);
+void qosd_policy_done(void);
+
+/* qosd_flows.c */
+int qosd_flows_init(void);
+void qosd_flows_delta(const struct nfct_entry *e, uint64_t *orig, uint64_t *reply);
+void qosd_flows_pass_end(void);
+void qosd_flows_done(void);
+
+/* qosd_topk.c */
+struct topk_acc;
+int qosd_topk_init(unsigned window);
+struct topk_acc *qosd_topk_acc_new(void);
+void qosd_topk_acc_free(struct topk_acc *acc);
+void qosd_topk_account(struct topk_acc *acc, const struct nfct_entry *e, uint64_t bytes);
+void qosd_topk_commit(struct topk_acc *acc);
+unsigned qosd_topk_destinations(const char **keys, unsigned max);
+void qosd_topk_method_init(struct ubus_method *method);
+void qosd_topk_done(void);
+
+/* qosd_probe.c */
+int qosd_probe_init(unsigned interval, unsigned budget);
+uint32_t qosd_probe_rtt_us(const char *ip);
+uint32_t qosd_probe_path_ms(const char *src, const char *dst);
+void qosd_probe_done(void);
+
+/* qosd_shm.c */
+int qosd_shm_init(const char *name, unsigned interval);
+void qosd_shm_publish(const struct host_stat *hosts);
+void qosd_shm_done(void);
+
+/* qosd_replay.c */
+int qosd_capture_run(const char *path, unsigned interval, unsigned count);
+int qosd_replay_run(const char *path, unsigned speed, const char *out, const char *baseline);
+
+/* qosd_alloc.c, linked into qosd-replay only; NULL elsewhere */
+void qosd_alloc_stats(uint32_t *allocs, uint32_t *bytes) __attribute__((weak));
+
+/* qosd_telemetry.c */
+int qosd_telemetry_init(unsigned window, unsigned rate, unsigned burst);
+void qosd_telemetry_classify(const struct classify_event *ev);
+void qosd_telemetry_done(void);
@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <malloc.h>
+
+#include "qosd.h"
+
+/*
+ * Allocation counting for replays, linked into qosd-replay only so that
+ * qosd-bin keeps calling libc directly.
+ *
+ * Defining malloc, calloc, realloc and free in the executable interposes
+ * them for the whole process, so allocations made inside libc (stdio
+ * buffers, getline, ...), libubox and json-c count as well as qosd's own.
+ * Every call goes on to the next definition, libc's, looked up with
+ * dlsym(RTLD_NEXT). dlsym() may allocate before that lookup is done;
+ * those few requests are served from a static arena and never freed.
+ *
+ * The aligned allocators and malloc_usable_size() are wrapped the same
+ * way. musl refuses aligned allocations with ENOMEM once malloc is
+ * replaced unless aligned_alloc is replaced as well, and their blocks
+ * must come from the same heap that free() goes to.
+ *
+ * The counters are 32 bits so that they stay lock-free on 32-bit
+ * targets; readers take differences between two reads modulo 2^32.
+ */
+
+#define ALLOC_ARENA_SIZE 4096
+#define ALLOC_ALIGN      16
+
+static void *(*g_malloc)(size_t);
+static void *(*g_calloc)(size_t, size_t);
+static void *(*g_realloc)(void *, size_t);
+static void (*g_free)(void *);
+static void *(*g_aligned_alloc)(size_t, size_t);
+static int (*g_posix_memalign)(void **, size_t, size_t);
+static void *(*g_memalign)(size_t, size_t);
+static size_t (*g_usable_size)(void *);
+static bool g_resolving;
+
+static _Alignas(ALLOC_ALIGN) char g_arena[ALLOC_ARENA_SIZE];
+static size_t g_arena_used;
+
+static uint32_t g_allocs;
+static uint32_t g_alloc_bytes;
+
+/* Zeroed memory for dlsym() itself */
+static void *arena_alloc(size_t size)
+{
+    size = (size + ALLOC_ALIGN - 1) & ~(size_t)(ALLOC_ALIGN - 1);
+    if (!size || size > sizeof(g_arena) - g_arena_used)
+        return NULL;
+
+    void *p = g_arena + g_arena_used;
+    g_arena_used += size;
+    return p;
+}
+
+static inline bool in_arena(const void *p)
+{
+    return (const char *)p >= g_arena && (const char *)p < g_arena + sizeof(g_arena);
+}
+
+/* False while the lookup itself allocates */
+static bool resolve(void)
+{
+    if (__atomic_load_n(&g_free, __ATOMIC_ACQUIRE))
+        return true;
+    if (g_resolving)
+        return false;
+
+    /* The first allocation happens before main(), on one thread */
+    g_resolving = true;
+    g_malloc = dlsym(RTLD_NEXT, "malloc");
+    g_calloc = dlsym(RTLD_NEXT, "calloc");
+    g_realloc = dlsym(RTLD_NEXT, "realloc");
+    g_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+    g_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+    g_memalign = dlsym(RTLD_NEXT, "memalign");
+    g_usable_size = dlsym(RTLD_NEXT, "malloc_usable_size");
+    void (*real_free)(void *) = dlsym(RTLD_NEXT, "free");
+    g_resolving = false;
+
+    if (!g_malloc || !g_calloc || !g_realloc || !g_aligned_alloc || !g_posix_memalign || !real_free)
+        abort();
+    __atomic_store_n(&g_free, real_free, __ATOMIC_RELEASE);
+    return true;
+}
+
+static inline void count_alloc(size_t size)
+{
+    __atomic_fetch_add(&g_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&g_alloc_bytes, (uint32_t)size, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size)
+{
+    if (!resolve())
+        return arena_alloc(size);
+    count_alloc(size);
+    return g_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    if (size && n > SIZE_MAX / size)
+        return NULL;
+    if (!resolve())
+        return arena_alloc(n * size);
+    count_alloc(n * size);
+    return g_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+    if (in_arena(p)) {
+        /* The old size is unknown; the arena's end bounds the copy */
+        size_t avail = (size_t)(g_arena + sizeof(g_arena) - (char *)p);
+        void *q = malloc(size);
+        if (q)
+            memcpy(q, p, size < avail ? size : avail);
+        return q;
+    }
+    if (!resolve())
+        return arena_alloc(size);
+    count_alloc(size);
+    return g_realloc(p, size);
+}
+
+void free(void *p)
+{
+    if (!p || in_arena(p) || !resolve())
+        return;
+    g_free(p);
+}
+
+/* The arena is ALLOC_ALIGN aligned; dlsym() asks for nothing stricter */
+static void *arena_aligned(size_t align, size_t size)
+{
+    return align <= ALLOC_ALIGN ? arena_alloc(size) : NULL;
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    if (!resolve())
+        return arena_aligned(align, size);
+    count_alloc(size);
+    return g_aligned_alloc(align, size);
+}
+
+int posix_memalign(void **p, size_t align, size_t size)
+{
+    if (!resolve()) {
+        *p = arena_aligned(align, size);
+        return *p ? 0 : ENOMEM;
+    }
+    count_alloc(size);
+    return g_posix_memalign(p, align, size);
+}
+
+void *memalign(size_t align, size_t size)
+{
+    if (!resolve())
+        return arena_aligned(align, size);
+    count_alloc(size);
+    /* Not every libc still exports it */
+    return g_memalign ? g_memalign(align, size) : g_aligned_alloc(align, size);
+}
+
+size_t malloc_usable_size(void *p)
+{
+    /* Arena blocks do not record their size */
+    if (!p || in_arena(p) || !resolve() || !g_usable_size)
+        return 0;
+    return g_usable_size(p);
+}
+
+/* Allocations made so far and their bytes, both modulo 2^32 */
+void qosd_alloc_stats(uint32_t *allocs, uint32_t *bytes)
+{
+    *allocs = __atomic_load_n(&g_allocs, __ATOMIC_RELAXED);
+    *bytes = __atomic_load_n(&g_alloc_bytes, __ATOMIC_RELAXED);
+}
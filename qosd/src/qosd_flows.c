@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "qosd.h"
+
+/*
+ * Per-flow byte deltas.
+ *
+ * Conntrack reports cumulative bytes per flow and forgets a flow once it
+ * closes, so diffing the sum of a host's current counters between passes
+ * loses whatever its closed flows moved, and goes backwards when a big one
+ * closes. Instead every pass looks each flow up in an 8-way
+ * set-associative table that remembers its last orig and reply counts,
+ * and hands back what each direction moved since.
+ *
+ * The table has four ways per nf_conntrack_max entry, up to
+ * FLOWS_MAX_BUCKETS. A flow without a way takes an empty one or one
+ * unseen since before the previous pass, and counts in full as a new
+ * flow. In a bucket without such a way, a live flow has to go: an idle
+ * one if possible, since it loses nothing by it. An evicted flow comes
+ * back within a pass and must not count its history again, so the bucket
+ * remembers the tag of the last one and takes it back as a baseline; once
+ * two are pending, every flow missing from the bucket only becomes a
+ * baseline until the pass after. An overfull table thus undercounts and
+ * never counts a history twice. qosd_stats.flow_evictions counts the
+ * evictions; while it grows, some bytes go uncounted.
+ *
+ * Ingest workers share the table; buckets are guarded by a small set of
+ * striped mutexes.
+ */
+
+#define FLOWS_WAYS         8
+#define FLOWS_PER_ENTRY    4        /* Ways per nf_conntrack_max entry */
+#define FLOWS_MIN_BUCKETS  1024
+#define FLOWS_MAX_BUCKETS  32768    /* 6.5 MiB, for 64k conntrack entries */
+#define FLOWS_LOCKS        64       /* Power of two */
+#define FLOWS_DEFAULT_MAX  16384    /* nf_conntrack_max when unreadable */
+#define FLOWS_PASS_MASK    0x7fffffffu
+#define CONNTRACK_MAX_FILE "/proc/sys/net/netfilter/nf_conntrack_max"
+
+struct flow_way {
+    uint64_t orig;
+    uint64_t reply;
+    uint32_t tag;          /* 0 = empty */
+    uint32_t pass : 31;    /* Last pass that saw the flow */
+    uint32_t idle : 1;     /* It moved nothing in that pass */
+};
+
+struct flow_bucket {
+    struct flow_way way[FLOWS_WAYS];
+    uint32_t ghost;        /* Tag of the last live flow evicted, 0 = none */
+    uint32_t ghost_pass;   /* When it was evicted */
+    uint32_t blind_pass;   /* Last time a live flow went while a ghost was pending */
+};
+
+static struct flow_bucket *g_buckets;
+static uint32_t g_mask;          /* Buckets - 1 */
+static uint32_t g_pass;          /* Modulo 2^31 */
+static bool g_primed;            /* The table holds a baseline */
+static uint32_t g_evictions;     /* Since the last pass end */
+static pthread_mutex_t g_locks[FLOWS_LOCKS];
+
+static uint64_t flow_hash(const struct nfct_entry *e)
+{
+    uint64_t h = 1469598103934665603ULL;
+    const unsigned char *parts[3] = {
+        (const unsigned char *)e->proto, (const unsigned char *)e->src, (const unsigned char *)e->dst
+    };
+
+    for (int i = 0; i < 3; i++) {
+        for (const unsigned char *p = parts[i]; *p; p++) {
+            h ^= *p;
+            h *= 1099511628211ULL;
+        }
+        h ^= '/';
+        h *= 1099511628211ULL;
+    }
+    h ^= ((uint64_t)e->sport << 16) | e->dport;
+
+    /* FNV's low bits mix poorly; finish with the murmur3 avalanche */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* Passes since `pass`: 0 if this one, 1 if the previous one */
+static inline uint32_t flow_age(uint32_t pass)
+{
+    return (g_pass - pass) & FLOWS_PASS_MASK;
+}
+
+/*
+ * Bytes the flow moved in each direction since the previous pass. Every
+ * flow must be passed once per pass; safe to call from several threads.
+ */
+void qosd_flows_delta(const struct nfct_entry *e, uint64_t *orig, uint64_t *reply)
+{
+    *orig = *reply = 0;
+    if (!g_buckets)
+        return;
+
+    uint64_t h = flow_hash(e);
+    uint32_t idx = (uint32_t)h & g_mask;
+    uint32_t tag = (uint32_t)(h >> 32) | 1;
+    struct flow_bucket *b = &g_buckets[idx];
+    struct flow_way *victim = NULL;
+    unsigned victim_rank = 0;
+    pthread_mutex_t *lock = &g_locks[idx & (FLOWS_LOCKS - 1)];
+
+    pthread_mutex_lock(lock);
+    for (unsigned i = 0; i < FLOWS_WAYS; i++) {
+        struct flow_way *w = &b->way[i];
+        if (w->tag == tag) {
+            /*
+             * Conntrack counters only grow: one that went back is a new
+             * connection on the same tuple, and counts from zero.
+             */
+            *orig = e->orig_bytes >= w->orig ? e->orig_bytes - w->orig : e->orig_bytes;
+            *reply = e->reply_bytes >= w->reply ? e->reply_bytes - w->reply : e->reply_bytes;
+            w->orig = e->orig_bytes;
+            w->reply = e->reply_bytes;
+            w->pass = g_pass;
+            w->idle = !*orig && !*reply;
+            pthread_mutex_unlock(lock);
+            return;
+        }
+
+        /* Empty or stale ways first, then idle flows, older ones first */
+        uint32_t age = flow_age(w->pass);
+        unsigned rank = !w->tag || age > 1 ? 4 : (w->idle ? 2 : 0) + age;
+        if (!victim || rank > victim_rank) {
+            victim = w;
+            victim_rank = rank;
+        }
+    }
+
+    bool returning = false;
+    if (b->ghost == tag && flow_age(b->ghost_pass) <= 1) {
+        b->ghost = 0;
+        returning = true;
+    } else if (flow_age(b->blind_pass) <= 1) {
+        returning = true;
+    }
+
+    bool evicting = victim_rank < 4;
+    if (evicting) {
+        if (b->ghost && flow_age(b->ghost_pass) <= 1) {
+            b->blind_pass = g_pass;
+        } else {
+            b->ghost = victim->tag;
+            b->ghost_pass = g_pass;
+        }
+    }
+    if (g_primed && !returning) {
+        *orig = e->orig_bytes;
+        *reply = e->reply_bytes;
+    }
+
+    bool evicted = g_primed && evicting;
+    victim->tag = tag;
+    victim->orig = e->orig_bytes;
+    victim->reply = e->reply_bytes;
+    victim->pass = g_pass;
+    victim->idle = false;
+    pthread_mutex_unlock(lock);
+
+    if (evicted)
+        __atomic_fetch_add(&g_evictions, 1, __ATOMIC_RELAXED);
+}
+
+/* Called on the uloop thread once every flow of a pass went through */
+void qosd_flows_pass_end(void)
+{
+    qosd_stats.flow_evictions += __atomic_exchange_n(&g_evictions, 0, __ATOMIC_RELAXED);
+    g_primed = g_buckets != NULL;
+    g_pass = (g_pass + 1) & FLOWS_PASS_MASK;
+}
+
+static unsigned conntrack_max(void)
+{
+    unsigned max = 0;
+    FILE *f = fopen(CONNTRACK_MAX_FILE, "r");
+    if (f) {
+        if (fscanf(f, "%u", &max) != 1)
+            max = 0;
+        fclose(f);
+    }
+    return max ? max : FLOWS_DEFAULT_MAX;
+}
+
+/* FLOWS_PER_ENTRY ways for each of `entries` flows, within the bucket limits */
+static int flows_alloc(unsigned entries)
+{
+    uint32_t buckets = FLOWS_MIN_BUCKETS;
+
+    while (buckets < FLOWS_MAX_BUCKETS &&
+           (uint64_t)buckets * FLOWS_WAYS < (uint64_t)FLOWS_PER_ENTRY * entries)
+        buckets <<= 1;
+
+    g_buckets = calloc(buckets, sizeof(*g_buckets));
+    if (!g_buckets)
+        return -1;
+    g_mask = buckets - 1;
+    g_pass = 2;    /* Zeroed ghost and blind passes read as long gone */
+    for (unsigned i = 0; i < FLOWS_LOCKS; i++)
+        pthread_mutex_init(&g_locks[i], NULL);
+    return 0;
+}
+
+int qosd_flows_init(void)
+{
+    return flows_alloc(conntrack_max());
+}
+
+void qosd_flows_done(void)
+{
+    if (!g_buckets)
+        return;
+
+    free(g_buckets);
+    g_buckets = NULL;
+    g_primed = false;
+    for (unsigned i = 0; i < FLOWS_LOCKS; i++)
+        pthread_mutex_destroy(&g_locks[i]);
+}
@@ -0,0 +1,384 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include <libubus.h>
+#include <libubox/blobmsg.h>
+#include <libubox/uloop.h>
+
+#include "qosd.h"
+
+/*
+ * Per-host rate history kept in the daemon so router-local graphs do not
+ * depend on the syslog -> Fluent Bit -> OpenSearch path.
+ *
+ * Every tracked host owns one slot with three rings: the last N raw
+ * samples, per-minute averages and per-hour averages. All rings live in a
+ * single array allocated at startup, so memory is fixed by the
+ * configuration: hosts * (N + HIST_MINUTE_SLOTS + HIST_HOUR_SLOTS) * 12
+ * bytes. Rates are stored as bytes per second in 32 bits (34 Gbit/s) and
+ * reported as bits per second like the live view.
+ *
+ * A slot is only claimed once a host has moved traffic; when all slots
+ * are taken the one idle for the longest time is recycled.
+ *
+ * Rates arrive whenever a conntrack pass completes, which callers other
+ * than the history timer trigger at any time. Each rate is therefore
+ * weighted by the time since the previous one, and a raw sample is the
+ * weighted average over one interval, so the tiers are spaced evenly and
+ * short passes do not count as much as long ones.
+ */
+
+#define HIST_MINUTE_SLOTS 180  /* 3 hours */
+#define HIST_HOUR_SLOTS   168  /* 1 week */
+
+enum {
+    TIER_RAW,
+    TIER_MINUTE,
+    TIER_HOUR,
+    __TIER_MAX
+};
+
+static const char *const tier_names[__TIER_MAX] = { "raw", "minute", "hour" };
+static const uint32_t tier_period[__TIER_MAX] = { 0, 60, 3600 };
+
+struct hist_sample {
+    uint32_t ts;      /* Wall clock, start of the bucket for averaged tiers */
+    uint32_t rx;      /* Bytes per second */
+    uint32_t tx;
+};
+
+struct hist_ring {
+    uint32_t head;    /* Next write position */
+    uint32_t count;
+};
+
+/* Time-weighted running average of the sample being filled */
+struct hist_acc {
+    uint32_t bucket;  /* Downsampled tiers only */
+    uint32_t ms;      /* Time covered */
+    uint64_t rx;      /* Bytes per second times ms */
+    uint64_t tx;
+};
+
+struct hist_slot {
+    char ip[64];
+    int host_idx;              /* Index in the live host table */
+    time_t last_active;        /* Last sample with non-zero traffic */
+    struct hist_ring ring[__TIER_MAX];
+    struct hist_acc acc[__TIER_MAX];
+    bool used;
+};
+
+static unsigned g_max_hosts;
+static uint32_t g_tier_size[__TIER_MAX];
+static uint32_t g_tier_offset[__TIER_MAX];
+static uint32_t g_per_slot;
+
+static struct hist_slot *g_slots;
+static struct hist_sample *g_samples;
+static int16_t g_slot_of[MAX_HOSTS];   /* Host index -> slot, -1 if none */
+
+static unsigned g_interval;
+static struct uloop_timeout g_timer;
+static uint64_t g_last_ms;      /* Monotonic time of the previous rates */
+static uint64_t g_raw_ms;       /* Monotonic time of the last raw sample */
+
+static inline struct hist_sample *tier_base(unsigned slot, int tier)
+{
+    return g_samples + (size_t)slot * g_per_slot + g_tier_offset[tier];
+}
+
+static void ring_push(unsigned slot, int tier, const struct hist_sample *s)
+{
+    struct hist_ring *r = &g_slots[slot].ring[tier];
+
+    tier_base(slot, tier)[r->head] = *s;
+    r->head = (r->head + 1) % g_tier_size[tier];
+    if (r->count < g_tier_size[tier])
+        r->count++;
+}
+
+static void acc_push(unsigned slot, int tier, uint32_t ts)
+{
+    struct hist_acc *a = &g_slots[slot].acc[tier];
+
+    if (a->ms) {
+        struct hist_sample avg = {
+            .ts = ts,
+            .rx = (uint32_t)(a->rx / a->ms),
+            .tx = (uint32_t)(a->tx / a->ms),
+        };
+        ring_push(slot, tier, &avg);
+    }
+    memset(a, 0, sizeof(*a));
+}
+
+/* rx/tx: bytes per second held for the last ms milliseconds */
+static void acc_add(unsigned slot, int tier, uint32_t now, uint32_t rx, uint32_t tx, uint32_t ms)
+{
+    struct hist_acc *a = &g_slots[slot].acc[tier];
+
+    if (tier != TIER_RAW) {
+        uint32_t bucket = now / tier_period[tier];
+        if (a->ms && a->bucket != bucket)
+            acc_push(slot, tier, a->bucket * tier_period[tier]);
+        a->bucket = bucket;
+    }
+
+    a->ms += ms;
+    a->rx += (uint64_t)rx * ms;
+    a->tx += (uint64_t)tx * ms;
+}
+
+static inline uint32_t bps_to_Bps(uint64_t bps)
+{
+    uint64_t v = bps / 8;
+    return v > UINT32_MAX ? UINT32_MAX : (uint32_t)v;
+}
+
+static int claim_slot(const struct host_stat *h, int host_idx)
+{
+    int victim = -1;
+
+    for (unsigned i = 0; i < g_max_hosts; i++) {
+        if (!g_slots[i].used) {
+            victim = (int)i;
+            break;
+        }
+        if (victim < 0 || g_slots[i].last_active < g_slots[victim].last_active)
+            victim = (int)i;
+    }
+
+    struct hist_slot *s = &g_slots[victim];
+    if (s->used && s->host_idx >= 0)
+        g_slot_of[s->host_idx] = -1;
+
+    memset(s, 0, sizeof(*s));
+    strncpy(s->ip, h->ip, sizeof(s->ip) - 1);
+    s->host_idx = host_idx;
+    s->used = true;
+    g_slot_of[host_idx] = (int16_t)victim;
+    return victim;
+}
+
+/* Called after every rate computation with the live host table */
+void qosd_history_record(const struct host_stat *hosts)
+{
+    if (!g_slots)
+        return;
+
+    time_t now = time(NULL);
+    uint64_t now_ms = qosd_monotonic_usec() / 1000;
+    uint64_t ms = g_last_ms ? now_ms - g_last_ms : 0;
+
+    g_last_ms = now_ms;
+    if (!g_raw_ms)
+        g_raw_ms = now_ms;
+    if (!ms)
+        return;
+    if (ms > UINT32_MAX)
+        ms = UINT32_MAX;
+
+    /*
+     * The timer asks for a pass every interval, but the pass is skipped
+     * when another caller ran one less than a second before, hence the
+     * slack of one second.
+     */
+    bool raw_due = now_ms - g_raw_ms + 1000 >= (uint64_t)g_interval * 1000;
+    if (raw_due)
+        g_raw_ms = now_ms;
+
+    for (int i = 0; i < MAX_HOSTS; i++) {
+        const struct host_stat *h = &hosts[i];
+        if (!h->used)
+            continue;
+
+        bool active = h->rx_bps || h->tx_bps;
+        int slot = g_slot_of[i];
+        if (slot >= 0 && strcmp(g_slots[slot].ip, h->ip) != 0) {
+            g_slot_of[i] = -1;
+            slot = -1;
+        }
+        if (slot < 0) {
+            if (!active)
+                continue;
+            slot = claim_slot(h, i);
+        }
+
+        if (active)
+            g_slots[slot].last_active = now;
+
+        uint32_t rx = bps_to_Bps(h->rx_bps);
+        uint32_t tx = bps_to_Bps(h->tx_bps);
+        for (int tier = 0; tier < __TIER_MAX; tier++)
+            acc_add((unsigned)slot, tier, (uint32_t)now, rx, tx, (uint32_t)ms);
+        if (raw_due)
+            acc_push((unsigned)slot, TIER_RAW, (uint32_t)now);
+    }
+}
+
+enum {
+    HIST_IP,
+    HIST_SINCE,
+    HIST_UNTIL,
+    HIST_TIER,
+    __HIST_MAX
+};
+
+static const struct blobmsg_policy history_policy[__HIST_MAX] = {
+    [HIST_IP]    = { .name = "ip",    .type = BLOBMSG_TYPE_STRING },
+    [HIST_SINCE] = { .name = "since", .type = BLOBMSG_TYPE_INT32 },
+    [HIST_UNTIL] = { .name = "until", .type = BLOBMSG_TYPE_INT32 },
+    [HIST_TIER]  = { .name = "tier",  .type = BLOBMSG_TYPE_STRING },
+};
+
+static void add_samples(struct blob_buf *b, unsigned slot, int tier, uint32_t since, uint32_t until)
+{
+    const struct hist_ring *r = &g_slots[slot].ring[tier];
+    const struct hist_sample *base = tier_base(slot, tier);
+    uint32_t size = g_tier_size[tier];
+    uint32_t start = (r->head + size - r->count) % size;
+
+    void *arr = blobmsg_open_array(b, "samples");
+    for (uint32_t k = 0; k < r->count; k++) {
+        const struct hist_sample *s = &base[(start + k) % size];
+        if (s->ts < since || s->ts > until)
+            continue;
+
+        void *t = blobmsg_open_array(b, NULL);
+        blobmsg_add_u32(b, NULL, s->ts);
+        blobmsg_add_u64(b, NULL, (uint64_t)s->rx * 8);
+        blobmsg_add_u64(b, NULL, (uint64_t)s->tx * 8);
+        blobmsg_close_array(b, t);
+    }
+
+    /* The bucket still being filled is reported with its running average */
+    const struct hist_acc *a = &g_slots[slot].acc[tier];
+    uint32_t ts = a->bucket * tier_period[tier];
+    if (tier != TIER_RAW && a->ms && ts >= since && ts <= until) {
+        void *t = blobmsg_open_array(b, NULL);
+        blobmsg_add_u32(b, NULL, ts);
+        blobmsg_add_u64(b, NULL, a->rx / a->ms * 8);
+        blobmsg_add_u64(b, NULL, a->tx / a->ms * 8);
+        blobmsg_close_array(b, t);
+    }
+    blobmsg_close_array(b, arr);
+}
+
+static int qosd_history_handler(struct ubus_context *ctx, struct ubus_object *obj,
+                                struct ubus_request_data *req, const char *method,
+                                struct blob_attr *msg)
+{
+    (void)obj;
+    (void)method;
+
+    struct blob_attr *tb[__HIST_MAX];
+    blobmsg_parse(history_policy, __HIST_MAX, tb, blob_data(msg), blob_len(msg));
+
+    const char *ip = tb[HIST_IP] ? blobmsg_get_string(tb[HIST_IP]) : NULL;
+    uint32_t since = tb[HIST_SINCE] ? blobmsg_get_u32(tb[HIST_SINCE]) : 0;
+    uint32_t until = tb[HIST_UNTIL] ? blobmsg_get_u32(tb[HIST_UNTIL]) : UINT32_MAX;
+    int tier = TIER_RAW;
+
+    if (tb[HIST_TIER]) {
+        const char *name = blobmsg_get_string(tb[HIST_TIER]);
+        for (tier = 0; tier < __TIER_MAX; tier++) {
+            if (!strcmp(name, tier_names[tier]))
+                break;
+        }
+        if (tier == __TIER_MAX)
+            return UBUS_STATUS_INVALID_ARGUMENT;
+    }
+
+    if (!g_slots)
+        return UBUS_STATUS_NOT_SUPPORTED;
+
+    const struct host_stat *hosts = qosd_live_hosts();
+    static struct blob_buf b;
+    blob_buf_init(&b, 0);
+    blobmsg_add_string(&b, "tier", tier_names[tier]);
+    blobmsg_add_u32(&b, "interval", tier == TIER_RAW ? g_interval : tier_period[tier]);
+
+    void *arr = blobmsg_open_array(&b, "hosts");
+    for (unsigned i = 0; i < g_max_hosts; i++) {
+        const struct hist_slot *s = &g_slots[i];
+        if (!s->used || (ip && strcmp(ip, s->ip) != 0))
+            continue;
+
+        const struct host_stat *h = &hosts[s->host_idx];
+        void *t = blobmsg_open_table(&b, NULL);
+        blobmsg_add_string(&b, "ip", s->ip);
+        blobmsg_add_string(&b, "hostname", h->used && !strcmp(h->ip, s->ip) ? h->hostname : "");
+        add_samples(&b, i, tier, since, until);
+        blobmsg_close_table(&b, t);
+    }
+    blobmsg_close_array(&b, arr);
+
+    return ubus_send_reply(ctx, req, b.head);
+}
+
+void qosd_history_method_init(struct ubus_method *method)
+{
+    *method = (struct ubus_method)UBUS_METHOD("history", qosd_history_handler, history_policy);
+}
+
+/* Sampling is otherwise driven by callers, so keep the rings fed */
+static void history_timer_cb(struct uloop_timeout *t)
+{
+    qosd_live_refresh();
+    uloop_timeout_set(t, (int)g_interval * 1000);
+}
+
+/*
+ * hosts: slots to keep, 0 disables history.
+ * samples: raw samples per host.
+ * interval: seconds between samples taken by the daemon itself.
+ */
+int qosd_history_init(unsigned hosts, unsigned samples, unsigned interval)
+{
+    if (!hosts || !samples || !interval)
+        return 0;
+    if (hosts > MAX_HOSTS)
+        hosts = MAX_HOSTS;
+
+    g_tier_size[TIER_RAW] = samples;
+    g_tier_size[TIER_MINUTE] = HIST_MINUTE_SLOTS;
+    g_tier_size[TIER_HOUR] = HIST_HOUR_SLOTS;
+
+    g_per_slot = 0;
+    for (int t = 0; t < __TIER_MAX; t++) {
+        g_tier_offset[t] = g_per_slot;
+        g_per_slot += g_tier_size[t];
+    }
+
+    g_slots = calloc(hosts, sizeof(*g_slots));
+    g_samples = calloc((size_t)hosts * g_per_slot, sizeof(*g_samples));
+    if (!g_slots || !g_samples) {
+        qosd_history_done();
+        return -1;
+    }
+
+    g_max_hosts = hosts;
+    g_interval = interval;
+    memset(g_slot_of, 0xff, sizeof(g_slot_of));
+
+    g_timer.cb = history_timer_cb;
+    uloop_timeout_set(&g_timer, (int)g_interval * 1000);
+    return 0;
+}
+
+void qosd_history_done(void)
+{
+    uloop_timeout_cancel(&g_timer);
+    free(g_slots);
+    free(g_samples);
+    g_slots = NULL;
+    g_samples = NULL;
+    g_max_hosts = 0;
+    g_last_ms = 0;
+    g_raw_ms = 0;
+}
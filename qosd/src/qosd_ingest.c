@@ -0,0 +1,651 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include <libubox/uloop.h>
+#include <syslog.h>
+
+#include "qosd.h"
+
+/*
+ * Optional worker pool for conntrack ingestion.
+ *
+ * A reader thread streams the conntrack file in fixed-size blocks cut at line
+ * boundaries and hands them to the parser threads. Each parser keeps its
+ * own open-addressing table of per-host partial aggregates, so the hot
+ * path takes no locks; the mutex is only touched once per block. When the
+ * file is exhausted and every block has been returned, the reader merges
+ * the per-thread tables and wakes the uloop thread through a pipe, which
+ * applies the result to the host table. Nothing here ever blocks uloop.
+ *
+ * The host table only takes MAX_HOSTS entries, and the inline sampler
+ * fills it in file order. To make the same choice, every aggregate
+ * remembers where in the file its host first appeared and the result is
+ * handed over with the hosts already in the table first and the new ones
+ * in file order. Every thread takes blocks in file order, so the first
+ * new hosts it meets are its earliest ones; it keeps the known hosts and
+ * at most as many new ones as the host table had room for at pass start,
+ * and drops the rest on sight. The merged earliest new hosts are among
+ * those kept, so the choice matches the inline sampler, although a
+ * kept host may miss entries another thread dropped when more new hosts
+ * show up in one pass than fit. Drops are counted in
+ * qosd_stats.host_overflows.
+ */
+
+#define INGEST_MAX_THREADS 16
+#define INGEST_BLOCK_SIZE  (256 * 1024)
+#define INGEST_TABLE_SIZE  (2 * MAX_HOSTS)  /* Power of two, grows on demand */
+#define INGEST_KNOWN_SIZE  (2 * MAX_HOSTS)  /* Power of two */
+
+struct ingest_block {
+    struct ingest_block *next;
+    uint32_t seq;              /* Position in the file, per pass */
+    size_t len;
+    char data[INGEST_BLOCK_SIZE + 1];
+};
+
+/* Open addressing, kept at most 3/4 full so probing always terminates */
+struct host_table {
+    struct ingest_host *slots;
+    unsigned size;
+    unsigned used;
+};
+
+struct ingest_worker {
+    pthread_t thread;
+    struct host_table hosts;
+    struct topk_acc *topk;     /* NULL when heavy-hitter tracking is off */
+    uint64_t lines;
+    uint64_t dropped;
+    unsigned fresh;            /* Hosts this pass that were not known */
+};
+
+/* A host that was in the host table when the pass started */
+struct known_host {
+    char ip[64];
+    char hostname[64];
+    bool used;
+};
+
+static unsigned g_threads;
+static struct ingest_worker g_workers[INGEST_MAX_THREADS];
+static pthread_t g_reader;
+static bool g_reader_started;
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
+static struct ingest_block *g_free;
+static struct ingest_block *g_ready_head;
+static struct ingest_block *g_ready_tail;
+static unsigned g_blocks_total;
+static unsigned g_blocks_free;
+static unsigned g_pass_gen;
+static bool g_stop;
+
+/* Read-only for the threads while a pass is in flight */
+static struct known_host *g_known;
+static char g_carry[INGEST_BLOCK_SIZE];
+
+static unsigned g_fresh_room;      /* Free host table slots at pass start */
+
+/* Written by the reader, consumed on the uloop thread */
+static struct host_table g_result;
+static unsigned g_result_count;    /* Sorted entries at the front of g_result */
+static uint64_t g_result_lines;
+static uint64_t g_result_dropped;
+
+static int g_notify[2] = { -1, -1 };
+static struct uloop_fd g_notify_fd;
+static bool g_busy;
+
+static uint32_t hash_ip(const char *ip)
+{
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)ip; *p; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static const struct known_host *lookup_known(const char *ip)
+{
+    uint32_t mask = INGEST_KNOWN_SIZE - 1;
+    for (uint32_t i = hash_ip(ip) & mask, n = 0; n < INGEST_KNOWN_SIZE; i = (i + 1) & mask, n++) {
+        if (!g_known[i].used)
+            return NULL;
+        if (strcmp(g_known[i].ip, ip) == 0)
+            return &g_known[i];
+    }
+    return NULL;
+}
+
+/* Returns the entry for ip, or the free slot where it belongs */
+static struct ingest_host *table_slot(struct host_table *t, const char *ip)
+{
+    uint32_t mask = t->size - 1;
+    uint32_t i = hash_ip(ip) & mask;
+
+    while (t->slots[i].used && strcmp(t->slots[i].ip, ip) != 0)
+        i = (i + 1) & mask;
+    return &t->slots[i];
+}
+
+/* Makes sure one more entry fits */
+static bool table_reserve(struct host_table *t)
+{
+    if (t->used < t->size / 4 * 3)
+        return true;
+
+    struct host_table grown = { .size = t->size * 2 };
+    grown.slots = calloc(grown.size, sizeof(*grown.slots));
+    if (!grown.slots)
+        return false;
+
+    for (unsigned i = 0; i < t->size; i++) {
+        if (t->slots[i].used)
+            *table_slot(&grown, t->slots[i].ip) = t->slots[i];
+    }
+    grown.used = t->used;
+    free(t->slots);
+    *t = grown;
+    return true;
+}
+
+/* Empties the table, a grown one goes back to its normal size */
+static void table_reset(struct host_table *t)
+{
+    struct ingest_host *slots = NULL;
+
+    if (t->size > INGEST_TABLE_SIZE)
+        slots = calloc(INGEST_TABLE_SIZE, sizeof(*slots));
+    if (slots) {
+        free(t->slots);
+        t->slots = slots;
+        t->size = INGEST_TABLE_SIZE;
+    } else {
+        memset(t->slots, 0, sizeof(*t->slots) * t->size);
+    }
+    t->used = 0;
+}
+
+static bool table_init(struct host_table *t)
+{
+    t->slots = calloc(INGEST_TABLE_SIZE, sizeof(*t->slots));
+    t->size = t->slots ? INGEST_TABLE_SIZE : 0;
+    t->used = 0;
+    return t->slots != NULL;
+}
+
+static void result_apply(struct ingest_host *e, const struct persona_result *res)
+{
+    if (res->confidence >= e->res.confidence)
+        e->res = *res;
+}
+
+/* pos orders entries like the file does: block, line, src before dst */
+static struct ingest_host *host_get(struct ingest_worker *w, const char *ip, uint64_t pos)
+{
+    struct ingest_host *e = table_slot(&w->hosts, ip);
+
+    if (!e->used) {
+        const struct known_host *k = lookup_known(ip);
+        if ((!k && w->fresh >= g_fresh_room) || !table_reserve(&w->hosts)) {
+            w->dropped++;
+            return NULL;
+        }
+        e = table_slot(&w->hosts, ip);
+        strncpy(e->ip, ip, sizeof(e->ip) - 1);
+        e->hostname = k && k->hostname[0] ? k->hostname : NULL;
+        e->first = pos;
+        e->known = k != NULL;
+        e->used = true;
+        w->hosts.used++;
+        if (!k)
+            w->fresh++;
+    }
+    e->entries++;
+    return e;
+}
+
+static void account(struct ingest_worker *w, const struct nfct_entry *ct, uint64_t pos)
+{
+    struct persona_result res;
+
+    uint64_t d_orig, d_reply;
+    qosd_flows_delta(ct, &d_orig, &d_reply);
+    if (w->topk)
+        qosd_topk_account(w->topk, ct, d_orig + d_reply);
+
+    if (ct->src[0]) {
+        struct ingest_host *e = host_get(w, ct->src, pos);
+        if (e) {
+            e->tx_bytes += d_orig;
+            nfct_classify(ct, e->hostname, &res);
+            result_apply(e, &res);
+        }
+    }
+    if (ct->dst[0]) {
+        struct ingest_host *e = host_get(w, ct->dst, pos | 1);
+        if (e) {
+            e->rx_bytes += d_reply;
+            nfct_classify(ct, e->hostname, &res);
+            result_apply(e, &res);
+        }
+    }
+}
+
+static void parse_block(struct ingest_worker *w, struct ingest_block *b)
+{
+    char *line = b->data;
+    char *end = b->data + b->len;
+    uint64_t pos = (uint64_t)b->seq << 33;
+
+    while (line < end) {
+        char *nl = memchr(line, '\n', (size_t)(end - line));
+        if (nl)
+            *nl = '\0';
+
+        struct nfct_entry ct;
+        w->lines++;
+        if (nfct_parse_line(line, &ct))
+            account(w, &ct, pos);
+        pos += 2;
+
+        line = nl ? nl + 1 : end;
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    struct ingest_worker *w = arg;
+
+    pthread_mutex_lock(&g_lock);
+    for (;;) {
+        while (!g_ready_head && !g_stop)
+            pthread_cond_wait(&g_cond, &g_lock);
+        if (g_stop)
+            break;
+
+        struct ingest_block *b = g_ready_head;
+        g_ready_head = b->next;
+        if (!g_ready_head)
+            g_ready_tail = NULL;
+        pthread_mutex_unlock(&g_lock);
+
+        parse_block(w, b);
+
+        pthread_mutex_lock(&g_lock);
+        b->next = g_free;
+        g_free = b;
+        g_blocks_free++;
+        pthread_cond_broadcast(&g_cond);
+    }
+    pthread_mutex_unlock(&g_lock);
+    return NULL;
+}
+
+static struct ingest_block *take_free_block(void)
+{
+    struct ingest_block *b = NULL;
+
+    pthread_mutex_lock(&g_lock);
+    while (!g_free && !g_stop)
+        pthread_cond_wait(&g_cond, &g_lock);
+    if (!g_stop) {
+        b = g_free;
+        g_free = b->next;
+        g_blocks_free--;
+    }
+    pthread_mutex_unlock(&g_lock);
+    return b;
+}
+
+static void push_ready(struct ingest_block *b)
+{
+    pthread_mutex_lock(&g_lock);
+    b->next = NULL;
+    if (g_ready_tail)
+        g_ready_tail->next = b;
+    else
+        g_ready_head = b;
+    g_ready_tail = b;
+    pthread_cond_broadcast(&g_cond);
+    pthread_mutex_unlock(&g_lock);
+}
+
+/* Stream the file into blocks; returns false when asked to stop */
+static bool read_pass(void)
+{
+    int fd = open(qosd_live_nfct_path(), O_RDONLY | O_CLOEXEC);
+    size_t carry = 0;
+    uint32_t seq = 0;
+    bool eof = fd < 0;
+
+    while (!eof) {
+        struct ingest_block *b = take_free_block();
+        if (!b) {
+            close(fd);
+            return false;
+        }
+
+        size_t len = carry;
+        memcpy(b->data, g_carry, carry);
+        carry = 0;
+
+        while (len < INGEST_BLOCK_SIZE) {
+            ssize_t r = read(fd, b->data + len, INGEST_BLOCK_SIZE - len);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0) {
+                eof = true;
+                break;
+            }
+            len += (size_t)r;
+        }
+
+        /* Hand over whole lines only; an oversized line is cut */
+        if (!eof) {
+            char *nl = memrchr(b->data, '\n', len);
+            if (nl) {
+                carry = len - (size_t)(nl + 1 - b->data);
+                memcpy(g_carry, nl + 1, carry);
+                len -= carry;
+            }
+        }
+
+        b->data[len] = '\0';
+        b->len = len;
+        b->seq = seq++;
+        push_ready(b);
+    }
+
+    if (fd >= 0)
+        close(fd);
+
+    pthread_mutex_lock(&g_lock);
+    while (g_blocks_free < g_blocks_total && !g_stop)
+        pthread_cond_wait(&g_cond, &g_lock);
+    bool stopped = g_stop;
+    pthread_mutex_unlock(&g_lock);
+    return !stopped;
+}
+
+/* Known hosts first, then new ones in the order the file names them */
+static int cmp_result(const void *a, const void *b)
+{
+    const struct ingest_host *ha = a, *hb = b;
+
+    if (ha->known != hb->known)
+        return ha->known ? -1 : 1;
+    return (ha->first > hb->first) - (ha->first < hb->first);
+}
+
+static void merge_workers(void)
+{
+    table_reset(&g_result);
+    g_result_lines = 0;
+    g_result_dropped = 0;
+
+    for (unsigned t = 0; t < g_threads; t++) {
+        struct ingest_worker *w = &g_workers[t];
+
+        for (unsigned i = 0; w->hosts.used && i < w->hosts.size; i++) {
+            const struct ingest_host *src = &w->hosts.slots[i];
+            if (!src->used)
+                continue;
+
+            struct ingest_host *dst = table_slot(&g_result, src->ip);
+            if (!dst->used) {
+                if (!table_reserve(&g_result)) {
+                    g_result_dropped += src->entries;
+                    continue;
+                }
+                *table_slot(&g_result, src->ip) = *src;
+                g_result.used++;
+                continue;
+            }
+            if (src->first < dst->first)
+                dst->first = src->first;
+            dst->entries += src->entries;
+            dst->rx_bytes += src->rx_bytes;
+            dst->tx_bytes += src->tx_bytes;
+            result_apply(dst, &src->res);
+        }
+
+        g_result_lines += w->lines;
+        g_result_dropped += w->dropped;
+        table_reset(&w->hosts);
+        w->lines = 0;
+        w->dropped = 0;
+        w->fresh = 0;
+    }
+
+    /*
+     * The hash layout is not needed anymore: sort in place and keep the
+     * known hosts plus as many new ones as the host table has room for.
+     */
+    struct ingest_host *e = g_result.slots;
+    unsigned n = 0, keep = 0;
+    for (unsigned i = 0; n < g_result.used && i < g_result.size; i++) {
+        if (e[i].used)
+            e[n++] = e[i];
+    }
+    qsort(e, n, sizeof(*e), cmp_result);
+
+    while (keep < n && e[keep].known)
+        keep++;
+    keep += n - keep < g_fresh_room ? n - keep : g_fresh_room;
+    for (unsigned i = keep; i < n; i++)
+        g_result_dropped += e[i].entries;
+    g_result_count = keep;
+}
+
+static void *reader_main(void *arg)
+{
+    (void)arg;
+    unsigned seen = 0;
+
+    pthread_mutex_lock(&g_lock);
+    for (;;) {
+        while (g_pass_gen == seen && !g_stop)
+            pthread_cond_wait(&g_cond, &g_lock);
+        if (g_stop)
+            break;
+        seen = g_pass_gen;
+        pthread_mutex_unlock(&g_lock);
+
+        if (!read_pass())
+            return NULL;
+
+        /* Every block is back on the free list, so the parsers are idle */
+        merge_workers();
+
+        char c = 0;
+        while (write(g_notify[1], &c, 1) < 0 && errno == EINTR)
+            ;
+
+        pthread_mutex_lock(&g_lock);
+    }
+    pthread_mutex_unlock(&g_lock);
+    return NULL;
+}
+
+static void notify_cb(struct uloop_fd *fd, unsigned int events)
+{
+    (void)events;
+    char buf[16];
+
+    while (read(fd->fd, buf, sizeof(buf)) > 0)
+        ;
+
+    if (!g_busy)
+        return;
+
+    g_busy = false;
+    qosd_flows_pass_end();
+    for (unsigned t = 0; t < g_threads; t++)
+        qosd_topk_commit(g_workers[t].topk);
+    qosd_stats.host_overflows += g_result_dropped;
+    qosd_live_ingest_complete(g_result.slots, g_result_count, g_result_lines);
+}
+
+bool qosd_ingest_enabled(void)
+{
+    return g_threads > 0;
+}
+
+bool qosd_ingest_busy(void)
+{
+    return g_busy;
+}
+
+/* Snapshot the known hosts and their lease hostnames, kick off a pass */
+int qosd_ingest_start(const struct host_stat *hosts)
+{
+    if (!g_threads)
+        return -EINVAL;
+    if (g_busy)
+        return -EBUSY;
+
+    uint32_t mask = INGEST_KNOWN_SIZE - 1;
+    memset(g_known, 0, sizeof(*g_known) * INGEST_KNOWN_SIZE);
+    g_fresh_room = MAX_HOSTS;
+    for (int i = 0; i < MAX_HOSTS; i++) {
+        if (!hosts[i].used)
+            continue;
+
+        g_fresh_room--;
+        uint32_t j = hash_ip(hosts[i].ip) & mask;
+        while (g_known[j].used)
+            j = (j + 1) & mask;
+        strncpy(g_known[j].ip, hosts[i].ip, sizeof(g_known[j].ip) - 1);
+        strncpy(g_known[j].hostname, hosts[i].hostname, sizeof(g_known[j].hostname) - 1);
+        g_known[j].used = true;
+    }
+
+    g_busy = true;
+    pthread_mutex_lock(&g_lock);
+    g_pass_gen++;
+    pthread_cond_broadcast(&g_cond);
+    pthread_mutex_unlock(&g_lock);
+    return 0;
+}
+
+int qosd_ingest_init(unsigned threads)
+{
+    if (!threads)
+        return 0;
+    if (threads > INGEST_MAX_THREADS)
+        threads = INGEST_MAX_THREADS;
+
+    g_known = calloc(INGEST_KNOWN_SIZE, sizeof(*g_known));
+    if (!g_known || !table_init(&g_result))
+        goto fail;
+
+    for (unsigned t = 0; t < threads; t++) {
+        if (!table_init(&g_workers[t].hosts))
+            goto fail;
+        g_workers[t].topk = qosd_topk_acc_new();
+    }
+
+    /* Two blocks per parser keep the reader one block ahead of each */
+    for (unsigned i = 0; i < threads * 2; i++) {
+        struct ingest_block *b = malloc(sizeof(*b));
+        if (!b)
+            goto fail;
+        b->next = g_free;
+        g_free = b;
+        g_blocks_total++;
+        g_blocks_free++;
+    }
+
+    if (pipe2(g_notify, O_CLOEXEC | O_NONBLOCK) < 0)
+        goto fail;
+
+    /* Leave signal delivery to the uloop thread */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    g_stop = false;
+    for (unsigned t = 0; t < threads; t++) {
+        if (pthread_create(&g_workers[t].thread, NULL, worker_main, &g_workers[t]) != 0)
+            break;
+        g_threads++;
+    }
+    if (g_threads == threads && pthread_create(&g_reader, NULL, reader_main, NULL) == 0)
+        g_reader_started = true;
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (!g_reader_started)
+        goto fail;
+
+    g_notify_fd.fd = g_notify[0];
+    g_notify_fd.cb = notify_cb;
+    uloop_fd_add(&g_notify_fd, ULOOP_READ);
+
+    syslog(LOG_INFO, "conntrack ingestion using %u threads", g_threads);
+    return 0;
+
+fail:
+    qosd_ingest_done();
+    return -1;
+}
+
+void qosd_ingest_done(void)
+{
+    pthread_mutex_lock(&g_lock);
+    g_stop = true;
+    pthread_cond_broadcast(&g_cond);
+    pthread_mutex_unlock(&g_lock);
+
+    if (g_reader_started)
+        pthread_join(g_reader, NULL);
+    for (unsigned t = 0; t < g_threads; t++)
+        pthread_join(g_workers[t].thread, NULL);
+    g_reader_started = false;
+    g_threads = 0;
+    g_busy = false;
+
+    if (g_notify_fd.registered)
+        uloop_fd_delete(&g_notify_fd);
+    for (int i = 0; i < 2; i++) {
+        if (g_notify[i] >= 0)
+            close(g_notify[i]);
+        g_notify[i] = -1;
+    }
+
+    /* Blocks may still sit on the ready queue if we stopped mid-pass */
+    while (g_ready_head) {
+        struct ingest_block *b = g_ready_head;
+        g_ready_head = b->next;
+        b->next = g_free;
+        g_free = b;
+    }
+    g_ready_tail = NULL;
+    while (g_free) {
+        struct ingest_block *b = g_free;
+        g_free = b->next;
+        free(b);
+    }
+    g_blocks_total = g_blocks_free = 0;
+
+    for (unsigned t = 0; t < INGEST_MAX_THREADS; t++) {
+        free(g_workers[t].hosts.slots);
+        qosd_topk_acc_free(g_workers[t].topk);
+        memset(&g_workers[t], 0, sizeof(g_workers[t]));
+    }
+    free(g_known);
+    free(g_result.slots);
+    memset(&g_result, 0, sizeof(g_result));
+    g_known = NULL;
+}
@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "qosd.h"
+
+/*
+ * Single-pass JSON object writer for the syslog telemetry events. Fields
+ * are appended straight into one buffer that is reused across events and
+ * only ever grows, so nothing is truncated and a steady-state event does
+ * not allocate. Keys are trusted literals and are copied verbatim.
+ */
+
+#define JSON_INITIAL_BUF 1024
+
+static bool json_reserve(struct json_writer *w, size_t extra)
+{
+    if (w->failed)
+        return false;
+    if (w->len + extra <= w->cap)
+        return true;
+
+    size_t cap = w->cap ? w->cap : JSON_INITIAL_BUF;
+    while (cap < w->len + extra)
+        cap *= 2;
+
+    char *buf = realloc(w->buf, cap);
+    if (!buf) {
+        w->failed = true;
+        return false;
+    }
+    w->buf = buf;
+    w->cap = cap;
+    return true;
+}
+
+static void json_raw(struct json_writer *w, const char *s, size_t len)
+{
+    if (!json_reserve(w, len))
+        return;
+    memcpy(w->buf + w->len, s, len);
+    w->len += len;
+}
+
+static void json_key(struct json_writer *w, const char *key)
+{
+    size_t klen = strlen(key);
+    if (!json_reserve(w, klen + 4))
+        return;
+
+    char *o = w->buf + w->len;
+    if (!w->first)
+        *o++ = ',';
+    *o++ = '"';
+    memcpy(o, key, klen);
+    o += klen;
+    *o++ = '"';
+    *o++ = ':';
+    w->len = (size_t)(o - w->buf);
+    w->first = false;
+}
+
+static inline bool needs_escape(unsigned char c)
+{
+    return c == '"' || c == '\\' || c <= 0x1F;
+}
+
+static void json_escaped(struct json_writer *w, const char *s)
+{
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *p = (const unsigned char *)(s ? s : "");
+    size_t n = 0;
+
+    /* Fast path: most values (IPs, personas, hostnames) need no escaping */
+    while (p[n] && !needs_escape(p[n]))
+        n++;
+    if (!p[n]) {
+        json_raw(w, (const char *)p, n);
+        return;
+    }
+
+    /* Worst case every remaining byte becomes a \u00XX sequence */
+    size_t rest = n + strlen((const char *)p + n) * 6;
+    if (!json_reserve(w, rest))
+        return;
+
+    char *o = w->buf + w->len;
+    memcpy(o, p, n);
+    o += n;
+    for (p += n; *p; p++) {
+        unsigned char c = *p;
+        if (c == '"' || c == '\\') {
+            *o++ = '\\';
+            *o++ = (char)c;
+        } else if (c <= 0x1F) {
+            *o++ = '\\';
+            *o++ = 'u';
+            *o++ = '0';
+            *o++ = '0';
+            *o++ = hex[c >> 4];
+            *o++ = hex[c & 0xF];
+        } else {
+            *o++ = (char)c;
+        }
+    }
+    w->len = (size_t)(o - w->buf);
+}
+
+void json_begin(struct json_writer *w)
+{
+    w->len = 0;
+    w->failed = false;
+    w->first = true;
+    json_raw(w, "{", 1);
+}
+
+void json_add_string(struct json_writer *w, const char *key, const char *val)
+{
+    json_key(w, key);
+    json_raw(w, "\"", 1);
+    json_escaped(w, val);
+    json_raw(w, "\"", 1);
+}
+
+void json_add_u64(struct json_writer *w, const char *key, uint64_t val)
+{
+    char digits[20];
+    size_t n = 0;
+
+    json_key(w, key);
+    do {
+        digits[n++] = (char)('0' + val % 10);
+        val /= 10;
+    } while (val);
+
+    if (!json_reserve(w, n))
+        return;
+    while (n)
+        w->buf[w->len++] = digits[--n];
+}
+
+/* Returns the NUL-terminated object, or NULL if the buffer could not grow */
+const char *json_end(struct json_writer *w)
+{
+    if (!json_reserve(w, 2))
+        return NULL;
+    w->buf[w->len++] = '}';
+    w->buf[w->len] = '\0';
+    return w->buf;
+}
+
+void json_free(struct json_writer *w)
+{
+    free(w->buf);
+    memset(w, 0, sizeof(*w));
+}
+
+void qosd_iso8601(time_t ts, char *buf, size_t len)
+{
+    struct tm tm;
+    if (!gmtime_r(&ts, &tm))
+        memset(&tm, 0, sizeof(tm));
+    strftime(buf, len, "%Y-%m-%dT%H:%M:%SZ", &tm);
+}
+
+/* Reformatted at most once per second */
+const char *qosd_timestamp_now(void)
+{
+    static char cached[32];
+    static time_t cached_at = -1;
+
+    time_t now = time(NULL);
+    if (now != cached_at) {
+        qosd_iso8601(now, cached, sizeof(cached));
+        cached_at = now;
+    }
+    return cached;
+}
+
+const char *qosd_router_id(void)
+{
+    static char cached[64] = {0};
+    static int initialized = 0;
+    if (!initialized) {
+        if (gethostname(cached, sizeof(cached)) != 0 || cached[0] == '\0')
+            strncpy(cached, "openwrt", sizeof(cached) - 1);
+        cached[sizeof(cached) - 1] = '\0';
+        initialized = 1;
+    }
+    return cached;
+}
@@ -15,88 +15,32 @@
 #include <inttypes.h>
 
 #include "classifier.h"
+#include "qosd.h"
 
-#define MAX_HOSTS 1024
-#define LEASES_FILE "/tmp/dhcp.leases"
-#define ARP_FILE    "/proc/net/arp"
-#define NFCT_FILE   "/proc/net/nf_conntrack"
+#define LIVE_MAX_DEFERRED 8
 
 #ifndef ARRAY_SIZE
 #define ARRAY_SIZE(x) (sizeof(x)/sizeof((x)[0]))
 #endif
 
-struct host_stat {
-    char ip[64];
-    char mac[32];
-    char hostname[64];
-    char persona[32];
-    char priority[16];
-    char policy_action[32];
-    char dscp[16];
-    uint8_t confidence;
-
-    uint64_t cur_rx_bytes;
-    uint64_t cur_tx_bytes;
-
-    uint64_t prev_rx_bytes;
-    uint64_t prev_tx_bytes;
-
-    uint64_t rx_bps;
-    uint64_t tx_bps;
-
-    time_t last_seen;
-    bool used;
-};
-
 static struct host_stat g_hosts[MAX_HOSTS];
-static time_t g_prev_tick = 0;
-
-static void iso8601_from_time(time_t ts, char *buf, size_t len)
-{
-    if (ts <= 0)
-        ts = time(NULL);
-    struct tm tm;
-    if (!gmtime_r(&ts, &tm))
-        memset(&tm, 0, sizeof(tm));
-    strftime(buf, len, "%Y-%m-%dT%H:%M:%SZ", &tm);
-}
-
-static const char *router_id(void)
-{
-    static char cached[64] = {0};
-    static int initialized = 0;
-    if (!initialized) {
-        if (gethostname(cached, sizeof(cached)) != 0 || cached[0] == '\0')
-            strncpy(cached, "openwrt", sizeof(cached) - 1);
-        cached[sizeof(cached) - 1] = '\0';
-        initialized = 1;
-    }
-    return cached;
-}
+static uint64_t g_prev_tick = 0;  /* Monotonic msec of the last rate computation */
+static uint64_t g_pass_started;
+static uint64_t g_virtual_usec;   /* Replay clock, 0 = CLOCK_MONOTONIC */
+
+static const char *g_leases_path = LEASES_FILE;
+static const char *g_arp_path = ARP_FILE;
+static const char *g_nfct_path = NFCT_FILE;
+
+/* live requests parked until an asynchronous ingest pass completes */
+struct live_deferred {
+    struct ubus_request_data req;
+    int limit;
+};
 
-static void json_escape(const char *in, char *out, size_t out_len)
-{
-    size_t oi = 0;
-    for (size_t i = 0; in && in[i] && oi + 1 < out_len; i++) {
-        unsigned char c = (unsigned char)in[i];
-        if (c == '"' || c == '\\') {
-            if (oi + 2 >= out_len)
-                break;
-            out[oi++] = '\\';
-            out[oi++] = c;
-        } else if (c <= 0x1F) {
-            if (oi + 6 >= out_len)
-                break;
-            int written = snprintf(out + oi, out_len - oi, "\\u%04x", c);
-            if (written < 0)
-                break;
-            oi += (size_t)written;
-        } else {
-            out[oi++] = c;
-        }
-    }
-    out[oi] = '\0';
-}
+static struct ubus_context *g_live_ctx;
+static struct live_deferred g_deferred[LIVE_MAX_DEFERRED];
+static unsigned g_n_deferred;
 
 static inline int find_host_idx(const char *ip, bool create)
 {
@@ -118,7 +62,7 @@ static inline int find_host_idx(const char *ip, bool create)
 
 static void load_leases(void)
 {
-    FILE *f = fopen(LEASES_FILE, "r");
+    FILE *f = fopen(g_leases_path, "r");
     if (!f)
         return;
 
@@ -139,7 +83,7 @@ static void load_leases(void)
 
 static void load_arp(void)
 {
-    FILE *f = fopen(ARP_FILE, "r");
+    FILE *f = fopen(g_arp_path, "r");
     if (!f)
         return;
 
@@ -171,109 +115,121 @@ static void reset_current_counters(void)
     }
 }
 
+bool nfct_parse_line(const char *line, struct nfct_entry *e)
+{
+    memset(e, 0, sizeof(*e));
+
+    sscanf(line, "%*s %*s %15s", e->proto);
+
+    const char *s1 = strstr(line, "src=");
+    const char *d1 = strstr(line, "dst=");
+    if (!s1 || !d1)
+        return false;
+
+    sscanf(s1, "src=%63s", e->src);
+    sscanf(d1, "dst=%63s", e->dst);
+
+    const char *sp = strstr(line, "sport=");
+    if (sp)
+        e->sport = (uint16_t)strtoul(sp + 6, NULL, 10);
+
+    const char *dp = strstr(line, "dport=");
+    if (dp)
+        e->dport = (uint16_t)strtoul(dp + 6, NULL, 10);
+
+    const char *b1 = strstr(line, " bytes=");
+    if (b1) {
+        b1 += 7;
+        e->orig_bytes = strtoull(b1, NULL, 10);
+        const char *b2 = strstr(b1, " bytes=");
+        if (b2) {
+            b2 += 7;
+            e->reply_bytes = strtoull(b2, NULL, 10);
+        }
+    }
+    return true;
+}
+
+void nfct_classify(const struct nfct_entry *e, const char *hostname, struct persona_result *res)
+{
+    struct persona_request req = {
+        .proto = e->proto,
+        .src_port = e->sport,
+        .dst_port = e->dport,
+        .hostname = (hostname && hostname[0]) ? hostname : NULL,
+        .bytes_total = e->orig_bytes + e->reply_bytes,
+        .latency_ms = qosd_probe_path_ms(e->src, e->dst),
+    };
+    memset(res, 0, sizeof(*res));
+    classify_persona(&req, res);
+}
+
+/* Keep the highest-confidence classification seen for the host this pass */
+static void host_apply_result(struct host_stat *h, const struct persona_result *res)
+{
+    if (res->confidence < h->confidence)
+        return;
+
+    strncpy(h->persona, res->persona, sizeof(h->persona) - 1);
+    strncpy(h->priority, res->priority, sizeof(h->priority) - 1);
+    strncpy(h->policy_action, res->policy_action, sizeof(h->policy_action) - 1);
+    strncpy(h->dscp, res->dscp, sizeof(h->dscp) - 1);
+    h->persona[sizeof(h->persona) - 1] = '\0';
+    h->priority[sizeof(h->priority) - 1] = '\0';
+    h->policy_action[sizeof(h->policy_action) - 1] = '\0';
+    h->dscp[sizeof(h->dscp) - 1] = '\0';
+    h->confidence = res->confidence;
+}
+
 static void sample_nfconntrack(void)
 {
-    FILE *f = fopen(NFCT_FILE, "r");
+    FILE *f = fopen(g_nfct_path, "r");
     if (!f)
         return;
 
+    uint64_t lines = 0;
     char line[2048];
     while (fgets(line, sizeof(line), f)) {
-        char *p = line;
-        char src[64] = {0}, dst[64] = {0};
-        char proto[16] = {0};
-        uint64_t orig_bytes = 0, reply_bytes = 0;
-        uint16_t sport = 0, dport = 0;
+        struct nfct_entry e;
+        struct persona_result res;
 
-        sscanf(line, "%*s %*s %15s", proto);
-
-        char *s1 = strstr(p, "src=");
-        char *d1 = strstr(p, "dst=");
-        if (!s1 || !d1)
+        lines++;
+        if (!nfct_parse_line(line, &e))
             continue;
 
-        sscanf(s1, "src=%63s", src);
-        sscanf(d1, "dst=%63s", dst);
-
-        char *sp = strstr(p, "sport=");
-        if (sp)
-            sport = (uint16_t)strtoul(sp + 6, NULL, 10);
-
-        char *dp = strstr(p, "dport=");
-        if (dp)
-            dport = (uint16_t)strtoul(dp + 6, NULL, 10);
-
-        char *b1 = strstr(p, " bytes=");
-        if (b1) {
-            b1 += 7;
-            orig_bytes = strtoull(b1, NULL, 10);
-            char *b2 = strstr(b1, " bytes=");
-            if (b2) {
-                b2 += 7;
-                reply_bytes = strtoull(b2, NULL, 10);
-            }
-        }
+        uint64_t d_orig, d_reply;
+        qosd_flows_delta(&e, &d_orig, &d_reply);
+        qosd_topk_account(NULL, &e, d_orig + d_reply);
 
-        if (src[0]) {
-            int is = find_host_idx(src, true);
+        if (e.src[0]) {
+            int is = find_host_idx(e.src, true);
             if (is >= 0) {
                 struct host_stat *h = &g_hosts[is];
-                h->cur_tx_bytes += orig_bytes;
+                h->cur_tx_bytes += d_orig;
                 h->last_seen = time(NULL);
 
-                struct persona_request req = {
-                    .proto = proto,
-                    .src_port = sport,
-                    .dst_port = dport,
-                    .hostname = h->hostname[0] ? h->hostname : NULL,
-                    .bytes_total = orig_bytes + reply_bytes,
-                };
-                struct persona_result res = {0};
-                classify_persona(&req, &res);
-                if (res.confidence >= h->confidence) {
-                    strncpy(h->persona, res.persona, sizeof(h->persona) - 1);
-                    strncpy(h->priority, res.priority, sizeof(h->priority) - 1);
-                    strncpy(h->policy_action, res.policy_action, sizeof(h->policy_action) - 1);
-                    strncpy(h->dscp, res.dscp, sizeof(h->dscp) - 1);
-                    h->persona[sizeof(h->persona) - 1] = '\0';
-                    h->priority[sizeof(h->priority) - 1] = '\0';
-                    h->policy_action[sizeof(h->policy_action) - 1] = '\0';
-                    h->dscp[sizeof(h->dscp) - 1] = '\0';
-                    h->confidence = res.confidence;
-                }
+                nfct_classify(&e, h->hostname, &res);
+                host_apply_result(h, &res);
+            } else {
+                qosd_stats.host_overflows++;
             }
         }
-        if (dst[0]) {
-            int id = find_host_idx(dst, true);
+        if (e.dst[0]) {
+            int id = find_host_idx(e.dst, true);
             if (id >= 0) {
                 struct host_stat *h = &g_hosts[id];
-                h->cur_rx_bytes += reply_bytes;
+                h->cur_rx_bytes += d_reply;
                 h->last_seen = time(NULL);
 
-                struct persona_request req = {
-                    .proto = proto,
-                    .src_port = sport,
-                    .dst_port = dport,
-                    .hostname = h->hostname[0] ? h->hostname : NULL,
-                    .bytes_total = orig_bytes + reply_bytes,
-                };
-                struct persona_result res = {0};
-                classify_persona(&req, &res);
-                if (res.confidence >= h->confidence) {
-                    strncpy(h->persona, res.persona, sizeof(h->persona) - 1);
-                    strncpy(h->priority, res.priority, sizeof(h->priority) - 1);
-                    strncpy(h->policy_action, res.policy_action, sizeof(h->policy_action) - 1);
-                    strncpy(h->dscp, res.dscp, sizeof(h->dscp) - 1);
-                    h->persona[sizeof(h->persona) - 1] = '\0';
-                    h->priority[sizeof(h->priority) - 1] = '\0';
-                    h->policy_action[sizeof(h->policy_action) - 1] = '\0';
-                    h->dscp[sizeof(h->dscp) - 1] = '\0';
-                    h->confidence = res.confidence;
-                }
+                nfct_classify(&e, h->hostname, &res);
+                host_apply_result(h, &res);
+            } else {
+                qosd_stats.host_overflows++;
             }
         }
     }
     fclose(f);
+    qosd_stats.conntrack_lines = lines;
 }
 
 static int cmp_bps_desc(const void *a, const void *b)
@@ -285,34 +241,40 @@ static int cmp_bps_desc(const void *a, const void *b)
     return (aa < bb) ? 1 : (aa > bb ? -1 : 0);
 }
 
-static void compute_bps_and_sort(unsigned limit, struct host_stat **out_list, unsigned *out_n)
+static void update_rates(void)
 {
-    time_t now = time(NULL);
-    double dt = difftime(now, g_prev_tick);
+    uint64_t now = qosd_monotonic_usec() / 1000;
+    bool baseline = g_prev_tick != 0;
+    double dt = baseline ? (double)(now - g_prev_tick) / 1000.0 : 1.0;
     if (dt <= 0.0)
         dt = 1.0;
 
-    unsigned n = 0;
     for (int i = 0; i < (int)ARRAY_SIZE(g_hosts); i++) {
         if (!g_hosts[i].used)
             continue;
 
-        uint64_t d_rx = 0, d_tx = 0;
-
-        if (g_hosts[i].cur_rx_bytes >= g_hosts[i].prev_rx_bytes)
-            d_rx = g_hosts[i].cur_rx_bytes - g_hosts[i].prev_rx_bytes;
-        if (g_hosts[i].cur_tx_bytes >= g_hosts[i].prev_tx_bytes)
-            d_tx = g_hosts[i].cur_tx_bytes - g_hosts[i].prev_tx_bytes;
+        /* Per-flow deltas, so closed flows keep what they moved */
+        uint64_t d_rx = g_hosts[i].cur_rx_bytes;
+        uint64_t d_tx = g_hosts[i].cur_tx_bytes;
 
         g_hosts[i].rx_bps = (uint64_t)((double)d_rx * 8.0 / dt);
         g_hosts[i].tx_bps = (uint64_t)((double)d_tx * 8.0 / dt);
 
-        g_hosts[i].prev_rx_bytes = g_hosts[i].cur_rx_bytes;
-        g_hosts[i].prev_tx_bytes = g_hosts[i].cur_tx_bytes;
+        g_hosts[i].rx_bytes_total += d_rx;
+        g_hosts[i].tx_bytes_total += d_tx;
+    }
 
-        out_list[n++] = &g_hosts[i];
-        if (n >= ARRAY_SIZE(g_hosts))
-            break;
+    g_prev_tick = now;
+    qosd_history_record(g_hosts);
+    qosd_shm_publish(g_hosts);
+}
+
+static void sort_by_bps(unsigned limit, struct host_stat **out_list, unsigned *out_n)
+{
+    unsigned n = 0;
+    for (int i = 0; i < (int)ARRAY_SIZE(g_hosts); i++) {
+        if (g_hosts[i].used)
+            out_list[n++] = &g_hosts[i];
     }
 
     qsort(out_list, n, sizeof(out_list[0]), cmp_bps_desc);
@@ -320,7 +282,6 @@ static void compute_bps_and_sort(unsigned limit, struct host_stat **out_list, un
     if (limit && n > limit)
         n = limit;
     *out_n = n;
-    g_prev_tick = now;
 }
 
 static void refresh_snapshot(void)
@@ -331,83 +292,172 @@ static void refresh_snapshot(void)
     sample_nfconntrack();
 }
 
+/* NULL keeps the current path */
+void qosd_live_set_paths(const char *nfct, const char *leases, const char *arp)
+{
+    if (nfct)
+        g_nfct_path = nfct;
+    if (leases)
+        g_leases_path = leases;
+    if (arp)
+        g_arp_path = arp;
+}
+
+const char *qosd_live_nfct_path(void)
+{
+    return g_nfct_path;
+}
+
+const char *qosd_live_leases_path(void)
+{
+    return g_leases_path;
+}
+
+const char *qosd_live_arp_path(void)
+{
+    return g_arp_path;
+}
+
+/* Replay runs on recorded time; 0 returns to the system clock */
+void qosd_live_set_clock(uint64_t usec)
+{
+    g_virtual_usec = usec;
+}
+
+uint64_t qosd_monotonic_usec(void)
+{
+    if (g_virtual_usec)
+        return g_virtual_usec;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
+
+/*
+ * Sample conntrack and recompute rates. Callers arriving less than a second
+ * after the last pass (live view, metrics scrapes) share its result instead
+ * of producing a noisy sub-second delta.
+ *
+ * Returns false when the pass was handed to the ingest worker pool; the
+ * table is then updated from qosd_live_ingest_complete() later on.
+ */
+bool qosd_live_refresh(void)
+{
+    if (g_prev_tick && qosd_monotonic_usec() / 1000 - g_prev_tick < 1000)
+        return true;
+
+    if (qosd_ingest_enabled()) {
+        if (!qosd_ingest_busy()) {
+            load_leases();
+            load_arp();
+            g_pass_started = qosd_monotonic_usec();
+            if (qosd_ingest_start(g_hosts) != 0)
+                return true;
+        }
+        return false;
+    }
+
+    uint64_t started = qosd_monotonic_usec();
+    refresh_snapshot();
+    update_rates();
+    qosd_flows_pass_end();
+    qosd_topk_commit(NULL);
+
+    qosd_stats.samples++;
+    qosd_stats.sample_usec = qosd_monotonic_usec() - started;
+    return true;
+}
+
+static void live_complete_deferred(void);
+
+/* hosts: known hosts first, then new ones in conntrack order */
+void qosd_live_ingest_complete(const struct ingest_host *hosts, unsigned n, uint64_t lines)
+{
+    time_t now = time(NULL);
+
+    reset_current_counters();
+    for (unsigned i = 0; i < n; i++) {
+        if (!hosts[i].used)
+            continue;
+
+        int idx = find_host_idx(hosts[i].ip, true);
+        if (idx < 0) {
+            qosd_stats.host_overflows += hosts[i].entries;
+            continue;
+        }
+
+        struct host_stat *h = &g_hosts[idx];
+        h->cur_rx_bytes += hosts[i].rx_bytes;
+        h->cur_tx_bytes += hosts[i].tx_bytes;
+        h->last_seen = now;
+        host_apply_result(h, &hosts[i].res);
+    }
+    update_rates();
+
+    qosd_stats.samples++;
+    qosd_stats.sample_usec = qosd_monotonic_usec() - g_pass_started;
+    qosd_stats.conntrack_lines = lines;
+
+    live_complete_deferred();
+}
+
+struct host_stat *qosd_live_hosts(void)
+{
+    return g_hosts;
+}
+
+uint64_t qosd_live_get_tick(void)
+{
+    return g_prev_tick;
+}
+
+void qosd_live_set_tick(uint64_t tick_ms)
+{
+    g_prev_tick = tick_ms;
+}
+
 static void log_live_snapshot(const struct host_stat *h)
 {
+    static struct json_writer jw;
+
     if (!h || !h->used)
         return;
 
-    char ts_now[32];
-    iso8601_from_time(time(NULL), ts_now, sizeof(ts_now));
-
     char ts_seen[32] = "";
     if (h->last_seen)
-        iso8601_from_time(h->last_seen, ts_seen, sizeof(ts_seen));
-
-    const char *hostname = h->hostname[0] ? h->hostname : "";
-    const char *ip = h->ip[0] ? h->ip : "";
-    const char *mac = h->mac[0] ? h->mac : "";
-    const char *persona = h->persona[0] ? h->persona : "";
-    const char *priority = h->priority[0] ? h->priority : "";
-    const char *policy = h->policy_action[0] ? h->policy_action : "";
-    const char *dscp = h->dscp[0] ? h->dscp : "";
-    const char *router = router_id();
-
-    char host_esc[128];
-    char ip_esc[80];
-    char mac_esc[48];
-    char persona_esc[48];
-    char pri_esc[48];
-    char policy_esc[48];
-    char dscp_esc[32];
-    char router_esc[64];
-    char seen_esc[40];
-
-    json_escape(hostname, host_esc, sizeof(host_esc));
-    json_escape(ip, ip_esc, sizeof(ip_esc));
-    json_escape(mac, mac_esc, sizeof(mac_esc));
-    json_escape(persona, persona_esc, sizeof(persona_esc));
-    json_escape(priority, pri_esc, sizeof(pri_esc));
-    json_escape(policy, policy_esc, sizeof(policy_esc));
-    json_escape(dscp, dscp_esc, sizeof(dscp_esc));
-    json_escape(router, router_esc, sizeof(router_esc));
-    json_escape(ts_seen, seen_esc, sizeof(seen_esc));
-
-    char payload[1024];
-    snprintf(payload, sizeof(payload),
-             "{\"event\":\"qosd_live\",\"timestamp\":\"%s\",\"hostname\":\"%s\","
-             "\"ip\":\"%s\",\"mac\":\"%s\",\"persona\":\"%s\",\"priority\":\"%s\","
-             "\"policy_action\":\"%s\",\"dscp\":\"%s\",\"confidence\":%u,"
-             "\"rx_bps\":%" PRIu64 ",\"tx_bps\":%" PRIu64 ",\"last_seen\":\"%s\","
-             "\"router\":\"%s\"}",
-             ts_now, host_esc, ip_esc, mac_esc, persona_esc, pri_esc,
-             policy_esc, dscp_esc, h->confidence,
-             h->rx_bps, h->tx_bps, seen_esc, router_esc);
-    syslog(LOG_INFO, "%s", payload);
+        qosd_iso8601(h->last_seen, ts_seen, sizeof(ts_seen));
+
+    json_begin(&jw);
+    json_add_string(&jw, "event", "qosd_live");
+    json_add_string(&jw, "timestamp", qosd_timestamp_now());
+    json_add_string(&jw, "hostname", h->hostname);
+    json_add_string(&jw, "ip", h->ip);
+    json_add_string(&jw, "mac", h->mac);
+    json_add_string(&jw, "persona", h->persona);
+    json_add_string(&jw, "priority", h->priority);
+    json_add_string(&jw, "policy_action", h->policy_action);
+    json_add_string(&jw, "dscp", h->dscp);
+    json_add_u64(&jw, "confidence", h->confidence);
+    json_add_u64(&jw, "rx_bps", h->rx_bps);
+    json_add_u64(&jw, "tx_bps", h->tx_bps);
+    json_add_string(&jw, "last_seen", ts_seen);
+    json_add_string(&jw, "router", qosd_router_id());
+
+    const char *payload = json_end(&jw);
+    if (payload)
+        syslog(LOG_INFO, "%s", payload);
 }
 
 static const struct blobmsg_policy live_policy[] = {
     { .name = "limit", .type = BLOBMSG_TYPE_INT32 },
 };
 
-int qosd_live_handler(struct ubus_context *ctx, struct ubus_object *obj,
-                      struct ubus_request_data *req, const char *method,
-                      struct blob_attr *msg)
+static int live_reply(struct ubus_context *ctx, struct ubus_request_data *req, int limit)
 {
-    (void)obj;
-    (void)method;
-
-    int limit = 50;
-    struct blob_attr *tb[ARRAY_SIZE(live_policy)];
-
-    blobmsg_parse(live_policy, ARRAY_SIZE(live_policy), tb, blob_data(msg), blob_len(msg));
-    if (tb[0])
-        limit = blobmsg_get_u32(tb[0]);
-
-    refresh_snapshot();
-
     struct host_stat *list[MAX_HOSTS];
     unsigned n = 0;
-    compute_bps_and_sort(limit, list, &n);
+    sort_by_bps(limit, list, &n);
 
     static struct blob_buf b;
     blob_buf_init(&b, 0);
@@ -428,6 +478,7 @@ int qosd_live_handler(struct ubus_context *ctx, struct ubus_object *obj,
         blobmsg_add_u64(&b, "tx_bps", h->tx_bps);
         blobmsg_add_u32(&b, "last_seen", (uint32_t)h->last_seen);
         blobmsg_add_u32(&b, "confidence", h->confidence);
+        blobmsg_add_u32(&b, "rtt_us", qosd_probe_rtt_us(h->ip));
         blobmsg_close_table(&b, t);
 
         log_live_snapshot(h);
@@ -437,6 +488,44 @@ int qosd_live_handler(struct ubus_context *ctx, struct ubus_object *obj,
     return ubus_send_reply(ctx, req, b.head);
 }
 
+static void live_complete_deferred(void)
+{
+    for (unsigned i = 0; i < g_n_deferred; i++) {
+        struct live_deferred *d = &g_deferred[i];
+        live_reply(g_live_ctx, &d->req, d->limit);
+        ubus_complete_deferred_request(g_live_ctx, &d->req, UBUS_STATUS_OK);
+    }
+    g_n_deferred = 0;
+}
+
+int qosd_live_handler(struct ubus_context *ctx, struct ubus_object *obj,
+                      struct ubus_request_data *req, const char *method,
+                      struct blob_attr *msg)
+{
+    (void)obj;
+    (void)method;
+
+    int limit = 50;
+    struct blob_attr *tb[ARRAY_SIZE(live_policy)];
+
+    blobmsg_parse(live_policy, ARRAY_SIZE(live_policy), tb, blob_data(msg), blob_len(msg));
+    if (tb[0])
+        limit = blobmsg_get_u32(tb[0]);
+
+    qosd_stats.live_calls++;
+
+    /* Answer once the pool finishes; beyond the queue, serve the last pass */
+    if (!qosd_live_refresh() && g_n_deferred < LIVE_MAX_DEFERRED) {
+        struct live_deferred *d = &g_deferred[g_n_deferred++];
+        g_live_ctx = ctx;
+        d->limit = limit;
+        ubus_defer_request(ctx, req, &d->req);
+        return 0;
+    }
+
+    return live_reply(ctx, req, limit);
+}
+
 void qosd_live_method_init(struct ubus_method *method)
 {
     *method = (struct ubus_method)UBUS_METHOD("live", qosd_live_handler, live_policy);
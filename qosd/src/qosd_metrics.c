@@ -0,0 +1,603 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <libubox/uloop.h>
+#include <libubox/usock.h>
+#include <syslog.h>
+#include <inttypes.h>
+#include <zlib.h>
+
+#include "qosd.h"
+
+/*
+ * Minimal HTTP/1.x listener serving the host table in OpenMetrics text
+ * format. Every connection gets exactly one response and is then closed.
+ * The body is rendered into a single buffer that is allocated once and
+ * only ever grows, so a steady-state scrape does not touch the allocator;
+ * responses are therefore written one client at a time.
+ */
+
+#define METRICS_MAX_CLIENTS 4
+#define METRICS_REQ_MAX     2048
+#define METRICS_TIMEOUT_MS  5000
+#define METRICS_INITIAL_BUF (32 * 1024)
+
+#define OPENMETRICS_CONTENT_TYPE \
+    "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+struct metrics_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+enum client_state {
+    CLIENT_FREE,
+    CLIENT_READING,
+    CLIENT_QUEUED,   /* Request parsed, waiting for the shared buffers */
+    CLIENT_WRITING,
+};
+
+struct metrics_client {
+    struct uloop_fd fd;
+    struct uloop_timeout timeout;
+    enum client_state state;
+
+    char req[METRICS_REQ_MAX];
+    size_t req_len;
+
+    char hdr[256];
+    size_t hdr_len;
+    const char *body;
+    size_t body_len;
+    size_t sent;
+
+    int status;
+    bool head;
+    bool gzip;
+};
+
+static struct uloop_fd g_listen = { .fd = -1 };
+static struct metrics_client g_clients[METRICS_MAX_CLIENTS];
+static struct metrics_client *g_writer;
+
+static struct metrics_buf g_text;
+static struct metrics_buf g_gz;
+static z_stream g_zs;
+static bool g_zs_ready;
+
+static bool mb_reserve(struct metrics_buf *b, size_t extra)
+{
+    if (b->len + extra <= b->cap)
+        return true;
+
+    size_t cap = b->cap ? b->cap : METRICS_INITIAL_BUF;
+    while (cap < b->len + extra)
+        cap *= 2;
+
+    char *data = realloc(b->data, cap);
+    if (!data)
+        return false;
+    b->data = data;
+    b->cap = cap;
+    return true;
+}
+
+static void mb_printf(struct metrics_buf *b, const char *fmt, ...)
+{
+    va_list ap;
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        size_t room = b->cap - b->len;
+        va_start(ap, fmt);
+        int n = vsnprintf(b->data + b->len, room, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+        if ((size_t)n < room) {
+            b->len += (size_t)n;
+            return;
+        }
+        if (!mb_reserve(b, (size_t)n + 1))
+            return;
+    }
+}
+
+/* Label values escape backslash, double quote and line feed */
+static void mb_label(struct metrics_buf *b, const char *name, const char *val, bool first)
+{
+    size_t vlen = strlen(val);
+    if (!mb_reserve(b, strlen(name) + vlen * 2 + 5))
+        return;
+
+    char *o = b->data + b->len;
+    if (!first)
+        *o++ = ',';
+    size_t nlen = strlen(name);
+    memcpy(o, name, nlen);
+    o += nlen;
+    *o++ = '=';
+    *o++ = '"';
+    for (size_t i = 0; i < vlen; i++) {
+        char c = val[i];
+        if (c == '\\' || c == '"') {
+            *o++ = '\\';
+            *o++ = c;
+        } else if (c == '\n') {
+            *o++ = '\\';
+            *o++ = 'n';
+        } else {
+            *o++ = c;
+        }
+    }
+    *o++ = '"';
+    b->len = (size_t)(o - b->data);
+}
+
+static void family(struct metrics_buf *b, const char *name, const char *type, const char *help)
+{
+    mb_printf(b, "# TYPE %s %s\n# HELP %s %s\n", name, type, name, help);
+}
+
+static void host_sample(struct metrics_buf *b, const char *metric,
+                        const struct host_stat *h, uint64_t val)
+{
+    mb_printf(b, "%s{", metric);
+    mb_label(b, "ip", h->ip, true);
+    mb_printf(b, "} %" PRIu64 "\n", val);
+}
+
+static void render_metrics(struct metrics_buf *b)
+{
+    const struct host_stat *hosts = qosd_live_hosts();
+    unsigned used = 0;
+
+    b->len = 0;
+
+    family(b, "qosd_host", "info", "Host identity and current persona classification.");
+    for (int i = 0; i < MAX_HOSTS; i++) {
+        const struct host_stat *h = &hosts[i];
+        if (!h->used)
+            continue;
+        used++;
+        mb_printf(b, "qosd_host_info{");
+        mb_label(b, "ip", h->ip, true);
+        mb_label(b, "mac", h->mac, false);
+        mb_label(b, "hostname", h->hostname, false);
+        mb_label(b, "persona", h->persona, false);
+        mb_label(b, "priority", h->priority, false);
+        mb_label(b, "policy_action", h->policy_action, false);
+        mb_label(b, "dscp", h->dscp, false);
+        mb_printf(b, "} 1\n");
+    }
+
+    static const struct {
+        const char *family;
+        const char *sample;
+        const char *type;
+        const char *help;
+        size_t offset;
+    } host_metrics[] = {
+        { "qosd_host_rx_bytes", "qosd_host_rx_bytes_total", "counter",
+          "Bytes received by the host, summed from conntrack deltas.",
+          offsetof(struct host_stat, rx_bytes_total) },
+        { "qosd_host_tx_bytes", "qosd_host_tx_bytes_total", "counter",
+          "Bytes sent by the host, summed from conntrack deltas.",
+          offsetof(struct host_stat, tx_bytes_total) },
+        { "qosd_host_rx_bps", "qosd_host_rx_bps", "gauge",
+          "Receive rate over the last sampling interval in bits per second.",
+          offsetof(struct host_stat, rx_bps) },
+        { "qosd_host_tx_bps", "qosd_host_tx_bps", "gauge",
+          "Transmit rate over the last sampling interval in bits per second.",
+          offsetof(struct host_stat, tx_bps) },
+    };
+
+    for (size_t m = 0; m < ARRAY_SIZE(host_metrics); m++) {
+        family(b, host_metrics[m].family, host_metrics[m].type, host_metrics[m].help);
+        for (int i = 0; i < MAX_HOSTS; i++) {
+            const struct host_stat *h = &hosts[i];
+            if (!h->used)
+                continue;
+            uint64_t val;
+            memcpy(&val, (const char *)h + host_metrics[m].offset, sizeof(val));
+            host_sample(b, host_metrics[m].sample, h, val);
+        }
+    }
+
+    family(b, "qosd_host_confidence", "gauge", "Persona classification confidence (0-100).");
+    for (int i = 0; i < MAX_HOSTS; i++) {
+        if (hosts[i].used)
+            host_sample(b, "qosd_host_confidence", &hosts[i], hosts[i].confidence);
+    }
+
+    family(b, "qosd_host_last_seen_seconds", "gauge", "Unix time the host last appeared in conntrack.");
+    for (int i = 0; i < MAX_HOSTS; i++) {
+        if (hosts[i].used && hosts[i].last_seen)
+            host_sample(b, "qosd_host_last_seen_seconds", &hosts[i], (uint64_t)hosts[i].last_seen);
+    }
+
+    family(b, "qosd_start_time_seconds", "gauge", "Unix time the daemon started.");
+    mb_printf(b, "qosd_start_time_seconds %lld\n", (long long)qosd_stats.start_time);
+
+    family(b, "qosd_hosts", "gauge", "Hosts currently tracked.");
+    mb_printf(b, "qosd_hosts %u\n", used);
+
+    family(b, "qosd_hosts_capacity", "gauge", "Size of the static host table.");
+    mb_printf(b, "qosd_hosts_capacity %d\n", MAX_HOSTS);
+
+    family(b, "qosd_host_overflows", "counter", "Conntrack entry directions dropped because the host table was full.");
+    mb_printf(b, "qosd_host_overflows_total %" PRIu64 "\n", qosd_stats.host_overflows);
+
+    family(b, "qosd_flow_evictions", "counter", "Live flows pushed out of the full per-flow byte table; while it grows, host and top byte counts miss some bytes.");
+    mb_printf(b, "qosd_flow_evictions_total %" PRIu64 "\n", qosd_stats.flow_evictions);
+
+    family(b, "qosd_ubus_requests", "counter", "ubus method invocations.");
+    mb_printf(b, "qosd_ubus_requests_total{method=\"classify\"} %" PRIu64 "\n", qosd_stats.classify_calls);
+    mb_printf(b, "qosd_ubus_requests_total{method=\"live\"} %" PRIu64 "\n", qosd_stats.live_calls);
+
+    family(b, "qosd_samples", "counter", "Completed conntrack sampling passes.");
+    mb_printf(b, "qosd_samples_total %" PRIu64 "\n", qosd_stats.samples);
+
+    family(b, "qosd_sample_duration_seconds", "gauge", "Duration of the last sampling pass.");
+    mb_printf(b, "qosd_sample_duration_seconds %" PRIu64 ".%06" PRIu64 "\n",
+              qosd_stats.sample_usec / 1000000, qosd_stats.sample_usec % 1000000);
+
+    family(b, "qosd_conntrack_entries", "gauge", "Conntrack entries read in the last sampling pass.");
+    mb_printf(b, "qosd_conntrack_entries %" PRIu64 "\n", qosd_stats.conntrack_lines);
+
+    family(b, "qosd_scrapes", "counter", "Metrics requests served.");
+    mb_printf(b, "qosd_scrapes_total %" PRIu64 "\n", qosd_stats.scrapes);
+
+    mb_printf(b, "# EOF\n");
+}
+
+static bool compress_body(const struct metrics_buf *in, struct metrics_buf *out)
+{
+    if (!g_zs_ready) {
+        /* 15 + 16: zlib window with a gzip header and trailer */
+        if (deflateInit2(&g_zs, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return false;
+        g_zs_ready = true;
+    } else if (deflateReset(&g_zs) != Z_OK) {
+        return false;
+    }
+
+    out->len = 0;
+    if (!mb_reserve(out, deflateBound(&g_zs, in->len)))
+        return false;
+
+    g_zs.next_in = (Bytef *)in->data;
+    g_zs.avail_in = (uInt)in->len;
+    g_zs.next_out = (Bytef *)out->data;
+    g_zs.avail_out = (uInt)out->cap;
+
+    if (deflate(&g_zs, Z_FINISH) != Z_STREAM_END)
+        return false;
+
+    out->len = out->cap - g_zs.avail_out;
+    return true;
+}
+
+static void client_close(struct metrics_client *c)
+{
+    uloop_timeout_cancel(&c->timeout);
+    uloop_fd_delete(&c->fd);
+    close(c->fd.fd);
+    c->fd.fd = -1;
+    c->state = CLIENT_FREE;
+    if (g_writer == c)
+        g_writer = NULL;
+
+    /* A slot is free again, resume accepting if we paused */
+    if (g_listen.fd >= 0 && !g_listen.registered)
+        uloop_fd_add(&g_listen, ULOOP_READ);
+}
+
+static void client_start_next(void);
+
+static void client_write(struct metrics_client *c)
+{
+    while (c->sent < c->hdr_len + c->body_len) {
+        struct iovec iov[2];
+        int n = 0;
+
+        if (c->sent < c->hdr_len) {
+            iov[n].iov_base = c->hdr + c->sent;
+            iov[n++].iov_len = c->hdr_len - c->sent;
+            if (c->body_len) {
+                iov[n].iov_base = (void *)c->body;
+                iov[n++].iov_len = c->body_len;
+            }
+        } else {
+            size_t off = c->sent - c->hdr_len;
+            iov[n].iov_base = (void *)(c->body + off);
+            iov[n++].iov_len = c->body_len - off;
+        }
+
+        ssize_t w = writev(c->fd.fd, iov, n);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            break;
+        }
+        c->sent += (size_t)w;
+    }
+
+    shutdown(c->fd.fd, SHUT_WR);
+    client_close(c);
+    client_start_next();
+}
+
+static void client_respond(struct metrics_client *c)
+{
+    const char *reason = "OK";
+    const char *ctype = OPENMETRICS_CONTENT_TYPE;
+    bool gzip = false;
+
+    g_writer = c;
+    c->state = CLIENT_WRITING;
+    c->body = NULL;
+    c->body_len = 0;
+
+    if (c->status == 200) {
+        qosd_live_refresh();
+        qosd_stats.scrapes++;
+        render_metrics(&g_text);
+        c->body = g_text.data;
+        c->body_len = g_text.len;
+
+        if (c->gzip && compress_body(&g_text, &g_gz)) {
+            c->body = g_gz.data;
+            c->body_len = g_gz.len;
+            gzip = true;
+        }
+    } else {
+        static const char not_found[] = "Not Found\n";
+        static const char bad_method[] = "Method Not Allowed\n";
+        static const char bad_request[] = "Bad Request\n";
+
+        ctype = "text/plain";
+        if (c->status == 404) {
+            reason = "Not Found";
+            c->body = not_found;
+        } else if (c->status == 405) {
+            reason = "Method Not Allowed";
+            c->body = bad_method;
+        } else {
+            reason = "Bad Request";
+            c->body = bad_request;
+        }
+        c->body_len = strlen(c->body);
+    }
+
+    int n = snprintf(c->hdr, sizeof(c->hdr),
+                     "HTTP/1.1 %d %s\r\n"
+                     "Content-Type: %s\r\n"
+                     "Content-Length: %zu\r\n"
+                     "%s"
+                     "Connection: close\r\n\r\n",
+                     c->status, reason, ctype, c->body_len,
+                     gzip ? "Content-Encoding: gzip\r\n" : "");
+    c->hdr_len = (n > 0 && (size_t)n < sizeof(c->hdr)) ? (size_t)n : 0;
+    if (c->head)
+        c->body_len = 0;
+    c->sent = 0;
+
+    uloop_fd_add(&c->fd, ULOOP_WRITE);
+    client_write(c);
+}
+
+static void client_start_next(void)
+{
+    if (g_writer)
+        return;
+
+    for (int i = 0; i < METRICS_MAX_CLIENTS; i++) {
+        if (g_clients[i].state == CLIENT_QUEUED) {
+            client_respond(&g_clients[i]);
+            return;
+        }
+    }
+}
+
+static bool header_has_token(const char *line, const char *name, const char *token)
+{
+    size_t nlen = strlen(name);
+    if (strncasecmp(line, name, nlen) != 0 || line[nlen] != ':')
+        return false;
+    return strcasestr(line + nlen + 1, token) != NULL;
+}
+
+/* Returns true once the full request head has been received and parsed */
+static bool client_parse(struct metrics_client *c)
+{
+    c->req[c->req_len] = '\0';
+    if (!strstr(c->req, "\r\n\r\n") && !strstr(c->req, "\n\n"))
+        return false;
+
+    char method[8] = "", path[128] = "";
+    c->status = 400;
+    if (sscanf(c->req, "%7s %127s", method, path) != 2)
+        return true;
+
+    c->head = strcmp(method, "HEAD") == 0;
+    if (strcmp(method, "GET") != 0 && !c->head) {
+        c->status = 405;
+        return true;
+    }
+
+    char *query = strchr(path, '?');
+    if (query)
+        *query = '\0';
+    if (strcmp(path, "/metrics") != 0 && strcmp(path, "/") != 0) {
+        c->status = 404;
+        return true;
+    }
+
+    c->status = 200;
+    for (char *line = strchr(c->req, '\n'); line; line = strchr(line, '\n')) {
+        line++;
+        if (header_has_token(line, "Accept-Encoding", "gzip"))
+            c->gzip = true;
+    }
+    return true;
+}
+
+static void client_cb(struct uloop_fd *fd, unsigned int events)
+{
+    struct metrics_client *c = container_of(fd, struct metrics_client, fd);
+
+    if (c->state == CLIENT_WRITING) {
+        if (events & ULOOP_WRITE)
+            client_write(c);
+        return;
+    }
+
+    if (c->state != CLIENT_READING)
+        return;
+
+    for (;;) {
+        ssize_t r = read(fd->fd, c->req + c->req_len, sizeof(c->req) - 1 - c->req_len);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            client_close(c);
+            return;
+        }
+        if (r == 0) {
+            client_close(c);
+            return;
+        }
+
+        c->req_len += (size_t)r;
+        if (client_parse(c))
+            break;
+        if (c->req_len >= sizeof(c->req) - 1) {
+            c->status = 400;
+            break;
+        }
+    }
+
+    uloop_fd_delete(&c->fd);
+    c->state = CLIENT_QUEUED;
+    client_start_next();
+}
+
+static void client_timeout_cb(struct uloop_timeout *t)
+{
+    struct metrics_client *c = container_of(t, struct metrics_client, timeout);
+    client_close(c);
+    client_start_next();
+}
+
+static void listen_cb(struct uloop_fd *fd, unsigned int events)
+{
+    (void)events;
+
+    for (;;) {
+        struct metrics_client *c = NULL;
+        for (int i = 0; i < METRICS_MAX_CLIENTS; i++) {
+            if (g_clients[i].state == CLIENT_FREE) {
+                c = &g_clients[i];
+                break;
+            }
+        }
+        if (!c) {
+            /* Leave further connections in the kernel backlog */
+            uloop_fd_delete(fd);
+            return;
+        }
+
+        int sock = accept(fd->fd, NULL, NULL);
+        if (sock < 0)
+            return;
+
+        memset(c, 0, sizeof(*c));
+        c->state = CLIENT_READING;
+        c->fd.fd = sock;
+        c->fd.cb = client_cb;
+        c->timeout.cb = client_timeout_cb;
+        uloop_fd_add(&c->fd, ULOOP_READ);
+        uloop_timeout_set(&c->timeout, METRICS_TIMEOUT_MS);
+    }
+}
+
+/* Accepts "port", "addr:port" or "[v6addr]:port" */
+int qosd_metrics_init(const char *listen)
+{
+    char host[64] = "";
+    const char *port = listen;
+
+    if (!listen || !*listen)
+        return -1;
+
+    const char *colon = strrchr(listen, ':');
+    if (colon) {
+        const char *start = listen;
+        size_t len = (size_t)(colon - listen);
+        if (len >= 2 && start[0] == '[' && start[len - 1] == ']') {
+            start++;
+            len -= 2;
+        }
+        if (len >= sizeof(host))
+            return -1;
+        memcpy(host, start, len);
+        host[len] = '\0';
+        port = colon + 1;
+    }
+
+    int fd = usock(USOCK_TCP | USOCK_SERVER | USOCK_NONBLOCK,
+                   host[0] ? host : NULL, port);
+    if (fd < 0)
+        return -1;
+
+    if (!mb_reserve(&g_text, METRICS_INITIAL_BUF)) {
+        close(fd);
+        return -1;
+    }
+
+    g_listen.fd = fd;
+    g_listen.cb = listen_cb;
+    uloop_fd_add(&g_listen, ULOOP_READ);
+
+    syslog(LOG_INFO, "metrics listener on %s", listen);
+    return 0;
+}
+
+void qosd_metrics_done(void)
+{
+    if (g_listen.fd < 0)
+        return;
+
+    uloop_fd_delete(&g_listen);
+    close(g_listen.fd);
+    g_listen.fd = -1;
+
+    for (int i = 0; i < METRICS_MAX_CLIENTS; i++) {
+        if (g_clients[i].state != CLIENT_FREE)
+            client_close(&g_clients[i]);
+    }
+
+    if (g_zs_ready)
+        deflateEnd(&g_zs);
+    g_zs_ready = false;
+
+    free(g_text.data);
+    free(g_gz.data);
+    memset(&g_text, 0, sizeof(g_text));
+    memset(&g_gz, 0, sizeof(g_gz));
+}
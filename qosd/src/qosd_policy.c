@@ -0,0 +1,396 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include <libubox/uloop.h>
+#include <libubox/usock.h>
+#include <json-c/json.h>
+#include <syslog.h>
+
+#include "qosd.h"
+
+/*
+ * Policy overlay pulled from the collector's /policies endpoint.
+ *
+ * A fetch is a plain HTTP/1.0 GET driven by uloop on a non-blocking
+ * socket, so ubus requests are never held up by a slow or absent
+ * collector. The last ETag is sent back as If-None-Match and a 304 keeps
+ * the current table. A 200 body is parsed into a fresh immutable overlay
+ * which is handed to the classifier with a single pointer swap. Ingest
+ * workers classify concurrently, so the swap (and freeing the previous
+ * table) waits until no ingest pass is running.
+ *
+ * The collector address must be numeric: name resolution would block the
+ * loop. After POLICY_MAX_FAILURES failed fetches in a row the overlay is
+ * dropped and the built-in profiles apply again.
+ */
+
+#define POLICY_MAX_RESPONSE  (64 * 1024)
+#define POLICY_MAX_ENTRIES   64
+#define POLICY_TIMEOUT_MS    5000
+#define POLICY_RETRY_MS      1000   /* Wait for an ingest pass before swapping */
+#define POLICY_MAX_FAILURES  3
+
+static char g_host[64];
+static char g_port[8];
+static char g_path[192];
+static unsigned g_interval;
+
+static struct uloop_timeout g_timer;
+static struct uloop_timeout g_io_timeout;
+static struct uloop_fd g_fd = { .fd = -1 };
+
+static char g_req[512];
+static size_t g_req_len;
+static size_t g_req_off;
+
+static char *g_resp;
+static size_t g_resp_len;
+
+static char g_etag[128];         /* ETag of the published overlay */
+static char g_pending_etag[128];
+static struct policy_overlay *g_pending;  /* Parsed, waiting for ingest to go idle */
+static unsigned g_failures;
+
+static void policy_schedule(int msecs)
+{
+    uloop_timeout_set(&g_timer, msecs);
+}
+
+static void policy_publish(struct policy_overlay *overlay, const char *etag)
+{
+    const struct policy_overlay *old = classifier_set_overlay(overlay);
+    free((void *)old);
+
+    strncpy(g_etag, etag, sizeof(g_etag) - 1);
+    g_etag[sizeof(g_etag) - 1] = '\0';
+}
+
+/* Swaps in the pending table, or retries shortly while workers classify */
+static bool policy_try_publish(void)
+{
+    if (!g_pending)
+        return true;
+    if (qosd_ingest_busy())
+        return false;
+
+    unsigned count = g_pending->count;
+    policy_publish(g_pending, g_pending_etag);
+    g_pending = NULL;
+    syslog(LOG_INFO, "policy overlay %s applied (%u personas)", g_etag[0] ? g_etag : "(no etag)", count);
+    return true;
+}
+
+static void policy_fail(const char *why)
+{
+    if (++g_failures == POLICY_MAX_FAILURES) {
+        syslog(LOG_WARNING, "policy fetch from %s:%s failed (%s), using built-in profiles",
+               g_host, g_port, why);
+        free(g_pending);
+        g_pending = NULL;
+        if (!qosd_ingest_busy())
+            policy_publish(NULL, "");
+        else
+            g_pending = calloc(1, sizeof(*g_pending));  /* Empty table, swapped in later */
+        g_pending_etag[0] = '\0';
+    }
+}
+
+static bool copy_field(struct json_object *obj, const char *key, char *dst, size_t len)
+{
+    struct json_object *val;
+
+    if (!json_object_object_get_ex(obj, key, &val) || !json_object_is_type(val, json_type_string))
+        return true;
+
+    const char *s = json_object_get_string(val);
+    if (strlen(s) >= len)
+        return false;
+    strcpy(dst, s);
+    return true;
+}
+
+/* { "<persona>": { "priority": ..., "policy_action": ..., "dscp": ... }, ... } */
+static struct policy_overlay *policy_parse(const char *body)
+{
+    struct json_object *root = json_tokener_parse(body);
+    if (!root)
+        return NULL;
+
+    struct policy_overlay *overlay = NULL;
+    if (!json_object_is_type(root, json_type_object))
+        goto out;
+
+    overlay = calloc(1, sizeof(*overlay) + POLICY_MAX_ENTRIES * sizeof(overlay->entries[0]));
+    if (!overlay)
+        goto out;
+
+    json_object_object_foreach(root, persona, val) {
+        if (overlay->count == POLICY_MAX_ENTRIES)
+            break;
+        if (!json_object_is_type(val, json_type_object))
+            continue;
+
+        struct persona_policy *p = &overlay->entries[overlay->count];
+        if (strlen(persona) >= sizeof(p->persona) ||
+            !copy_field(val, "priority", p->priority, sizeof(p->priority)) ||
+            !copy_field(val, "policy_action", p->policy_action, sizeof(p->policy_action)) ||
+            !copy_field(val, "dscp", p->dscp, sizeof(p->dscp))) {
+            memset(p, 0, sizeof(*p));
+            continue;
+        }
+        strcpy(p->persona, persona);
+        overlay->count++;
+    }
+
+out:
+    json_object_put(root);
+    return overlay;
+}
+
+static void header_value(const char *headers, const char *name, char *out, size_t len)
+{
+    size_t nlen = strlen(name);
+    out[0] = '\0';
+
+    for (const char *line = strstr(headers, "\r\n"); line; line = strstr(line, "\r\n")) {
+        line += 2;
+        if (strncasecmp(line, name, nlen) != 0 || line[nlen] != ':')
+            continue;
+
+        const char *v = line + nlen + 1;
+        while (*v == ' ' || *v == '\t')
+            v++;
+        size_t vlen = strcspn(v, "\r\n");
+        if (vlen < len) {
+            memcpy(out, v, vlen);
+            out[vlen] = '\0';
+        }
+        return;
+    }
+}
+
+static void policy_handle_response(void)
+{
+    char *body = g_resp ? strstr(g_resp, "\r\n\r\n") : NULL;
+    int status = 0;
+
+    if (!body || sscanf(g_resp, "HTTP/%*d.%*d %d", &status) != 1) {
+        policy_fail("malformed response");
+        return;
+    }
+    *body = '\0';
+    body += 4;
+
+    if (status == 304) {
+        g_failures = 0;
+        return;
+    }
+    if (status != 200) {
+        policy_fail("unexpected status");
+        return;
+    }
+
+    char etag[sizeof(g_pending_etag)];
+    header_value(g_resp, "ETag", etag, sizeof(etag));
+
+    struct policy_overlay *overlay = policy_parse(body);
+    if (!overlay) {
+        policy_fail("invalid policy document");
+        return;
+    }
+
+    g_failures = 0;
+    free(g_pending);
+    g_pending = overlay;
+    strcpy(g_pending_etag, etag);
+}
+
+static void policy_close(void)
+{
+    uloop_timeout_cancel(&g_io_timeout);
+    if (g_fd.fd >= 0) {
+        uloop_fd_delete(&g_fd);
+        close(g_fd.fd);
+        g_fd.fd = -1;
+    }
+    free(g_resp);
+    g_resp = NULL;
+    g_resp_len = 0;
+}
+
+static void policy_finish(bool ok)
+{
+    if (ok)
+        policy_handle_response();
+    else
+        policy_fail("connection failed");
+    policy_close();
+
+    policy_schedule(policy_try_publish() ? (int)g_interval * 1000 : POLICY_RETRY_MS);
+}
+
+static bool policy_read(void)
+{
+    for (;;) {
+        if (g_resp_len >= POLICY_MAX_RESPONSE)
+            return false;
+
+        if (!g_resp) {
+            g_resp = malloc(POLICY_MAX_RESPONSE + 1);
+            if (!g_resp)
+                return false;
+        }
+
+        ssize_t n = read(g_fd.fd, g_resp + g_resp_len, POLICY_MAX_RESPONSE - g_resp_len);
+        if (n > 0) {
+            g_resp_len += (size_t)n;
+            g_resp[g_resp_len] = '\0';
+            continue;
+        }
+        if (n == 0) {
+            policy_finish(true);
+            return true;
+        }
+        if (errno == EINTR)
+            continue;
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+}
+
+static void policy_fd_cb(struct uloop_fd *fd, unsigned int events)
+{
+    if (g_req_off < g_req_len) {
+        int err = 0;
+        socklen_t elen = sizeof(err);
+        if (getsockopt(fd->fd, SOL_SOCKET, SO_ERROR, &err, &elen) || err) {
+            policy_finish(false);
+            return;
+        }
+
+        ssize_t n = write(fd->fd, g_req + g_req_off, g_req_len - g_req_off);
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            policy_finish(false);
+            return;
+        }
+        if (n > 0)
+            g_req_off += (size_t)n;
+        if (g_req_off == g_req_len)
+            uloop_fd_add(fd, ULOOP_READ);
+        return;
+    }
+
+    if ((events & ULOOP_READ) && !policy_read())
+        policy_finish(false);
+}
+
+static void policy_io_timeout_cb(struct uloop_timeout *t)
+{
+    (void)t;
+    policy_finish(false);
+}
+
+static void policy_timer_cb(struct uloop_timeout *t)
+{
+    (void)t;
+
+    /* A parsed table is still waiting for the ingest pass to end */
+    if (!policy_try_publish()) {
+        policy_schedule(POLICY_RETRY_MS);
+        return;
+    }
+
+    int fd = usock(USOCK_TCP | USOCK_NONBLOCK | USOCK_NUMERIC, g_host, g_port);
+    if (fd < 0) {
+        policy_fail("connect failed");
+        policy_schedule((int)g_interval * 1000);
+        return;
+    }
+
+    int len = snprintf(g_req, sizeof(g_req),
+                       "GET %s HTTP/1.0\r\n"
+                       "Host: %s:%s\r\n"
+                       "Accept: application/json\r\n"
+                       "%s%s%s"
+                       "Connection: close\r\n\r\n",
+                       g_path, g_host, g_port,
+                       g_etag[0] ? "If-None-Match: " : "", g_etag, g_etag[0] ? "\r\n" : "");
+    g_req_len = (size_t)len < sizeof(g_req) ? (size_t)len : sizeof(g_req) - 1;
+    g_req_off = 0;
+
+    g_fd.fd = fd;
+    g_fd.cb = policy_fd_cb;
+    uloop_fd_add(&g_fd, ULOOP_WRITE);
+
+    g_io_timeout.cb = policy_io_timeout_cb;
+    uloop_timeout_set(&g_io_timeout, POLICY_TIMEOUT_MS);
+}
+
+/* http://<numeric host>[:port][/path], IPv6 hosts in brackets */
+static int policy_parse_url(const char *url)
+{
+    const char *p = url;
+    if (strncmp(p, "http://", 7) != 0)
+        return -1;
+    p += 7;
+
+    const char *host_end;
+    if (*p == '[') {
+        host_end = strchr(++p, ']');
+        if (!host_end)
+            return -1;
+    } else {
+        host_end = p + strcspn(p, ":/");
+    }
+
+    size_t hlen = (size_t)(host_end - p);
+    if (!hlen || hlen >= sizeof(g_host))
+        return -1;
+    memcpy(g_host, p, hlen);
+    g_host[hlen] = '\0';
+
+    p = host_end + (*host_end == ']');
+    strcpy(g_port, "80");
+    if (*p == ':') {
+        size_t plen = strcspn(++p, "/");
+        if (!plen || plen >= sizeof(g_port))
+            return -1;
+        memcpy(g_port, p, plen);
+        g_port[plen] = '\0';
+        p += plen;
+    }
+
+    if (strlen(p) >= sizeof(g_path))
+        return -1;
+    strcpy(g_path, *p ? p : "/policies");
+    return 0;
+}
+
+/* Polls `url` every `interval` seconds, starting right away */
+int qosd_policy_init(const char *url, unsigned interval)
+{
+    if (!url || !*url || !interval || policy_parse_url(url))
+        return -1;
+
+    g_interval = interval;
+    g_timer.cb = policy_timer_cb;
+    policy_schedule(0);
+    return 0;
+}
+
+void qosd_policy_done(void)
+{
+    uloop_timeout_cancel(&g_timer);
+    policy_close();
+    free(g_pending);
+    g_pending = NULL;
+
+    /* Ingest workers are already stopped */
+    free((void *)classifier_set_overlay(NULL));
+}
@@ -0,0 +1,440 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip_icmp.h>
+#include <sys/socket.h>
+
+#include <libubox/uloop.h>
+#include <syslog.h>
+
+#include "qosd.h"
+
+/*
+ * Round-trip times for the latency-aware persona refinements.
+ *
+ * Every interval the prober sends ICMP echo requests to the LAN hosts
+ * seen in the last PROBE_ACTIVE_S seconds and to the heaviest remote
+ * destinations, at most `budget` packets per interval. Targets are
+ * visited round-robin, so with more targets than budget each one is
+ * probed every few intervals. Requests go out in sendmmsg batches and
+ * replies are drained with recvmmsg from a uloop fd; nothing blocks.
+ *
+ * The send time travels in the echo payload, so no per-probe state is
+ * kept. Results live in a table of PROBE_WAYS-way buckets holding the
+ * IPv4 address and its EWMA RTT (alpha 1/8, as TCP's SRTT) in separate
+ * 32-bit words, which ingest workers read without locks: the address is
+ * read again after the RTT, so a way handed to another target meanwhile
+ * reads as unmeasured. A full bucket gives up the way of the target sent
+ * to least recently. A target that misses PROBE_MAX_MISSES replies in a
+ * row reports no RTT until it answers.
+ *
+ * A raw socket needs CAP_NET_RAW; without it the unprivileged ICMP
+ * datagram socket is used (net.ipv4.ping_group_range). IPv6 hosts are
+ * not probed.
+ */
+
+#define PROBE_BUCKET_BITS 9
+#define PROBE_BUCKETS     (1u << PROBE_BUCKET_BITS)
+#define PROBE_WAYS        8
+#define PROBE_BATCH       64    /* Messages per sendmmsg/recvmmsg */
+#define PROBE_MAX_PEERS   8     /* Remote destinations probed */
+#define PROBE_MAX_TARGETS (MAX_HOSTS + PROBE_MAX_PEERS)
+#define PROBE_MAX_MISSES  3
+#define PROBE_ACTIVE_S    300
+#define PROBE_MAX_RTT_US  (10 * 1000 * 1000)
+#define PROBE_MAGIC       0x716f7364u  /* "qosd" */
+#define PROBE_BUF_LEN     128
+
+struct probe_packet {
+    struct icmphdr hdr;
+    uint64_t sent_usec;   /* Monotonic clock */
+    uint32_t magic;
+    uint32_t addr;        /* Target, network order */
+};
+
+struct probe_entry {
+    uint32_t addr;        /* Network order, 0 = free */
+    uint32_t rtt_us;      /* EWMA, 0 = none */
+    uint32_t round;       /* Round of the last request */
+    uint8_t misses;
+    bool outstanding;     /* Sent, no reply yet */
+};
+
+static struct probe_entry *g_table;
+static struct uloop_fd g_fd = { .fd = -1 };
+static struct uloop_timeout g_timer;
+static bool g_raw;
+static uint16_t g_id;
+static uint16_t g_seq;
+static unsigned g_interval;
+static unsigned g_budget;
+static unsigned g_cursor;
+static uint32_t g_round;
+static uint32_t g_targets[PROBE_MAX_TARGETS];
+
+static inline struct probe_entry *probe_bucket(uint32_t addr)
+{
+    /* Fibonacci hashing in host order, so the last octet reaches the top bits */
+    uint32_t h = ntohl(addr) * 2654435761u;
+    return &g_table[(h >> (32 - PROBE_BUCKET_BITS)) * PROBE_WAYS];
+}
+
+/* uloop thread only, which owns every field but reads addr and rtt_us */
+static struct probe_entry *probe_find(uint32_t addr)
+{
+    struct probe_entry *b = probe_bucket(addr);
+    for (unsigned i = 0; i < PROBE_WAYS; i++) {
+        if (b[i].addr == addr)
+            return &b[i];
+    }
+    return NULL;
+}
+
+static inline void entry_set_rtt(struct probe_entry *p, uint32_t rtt_us)
+{
+    __atomic_store_n(&p->rtt_us, rtt_us, __ATOMIC_RELEASE);
+}
+
+/*
+ * The way holding `addr`, else a free one or the least recently sent.
+ * Ways fill in order and are never freed, so `addr` is not past a free one.
+ */
+static struct probe_entry *probe_claim(uint32_t addr)
+{
+    struct probe_entry *b = probe_bucket(addr);
+    struct probe_entry *victim = &b[0];
+
+    for (unsigned i = 0; i < PROBE_WAYS; i++) {
+        if (b[i].addr == addr)
+            return &b[i];
+        if (!b[i].addr) {
+            victim = &b[i];
+            break;
+        }
+        if (g_round - b[i].round > g_round - victim->round)
+            victim = &b[i];
+    }
+
+    /* Clear the RTT before the address so readers never pair them wrong */
+    entry_set_rtt(victim, 0);
+    __atomic_store_n(&victim->addr, addr, __ATOMIC_RELEASE);
+    victim->misses = 0;
+    victim->outstanding = false;
+    return victim;
+}
+
+static uint16_t icmp_checksum(const void *data, size_t len)
+{
+    const uint16_t *w = data;
+    uint32_t sum = 0;
+
+    for (; len > 1; len -= 2)
+        sum += *w++;
+    if (len)
+        sum += *(const uint8_t *)w;
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum += sum >> 16;
+    return (uint16_t)~sum;
+}
+
+/* Unicast IPv4 only; 0.0.0.0/8, multicast and broadcast are skipped */
+static bool parse_target(const char *ip, uint32_t *addr)
+{
+    struct in_addr in;
+    if (inet_pton(AF_INET, ip, &in) != 1)
+        return false;
+
+    uint8_t first = (uint8_t)(ntohl(in.s_addr) >> 24);
+    if (first == 0 || first >= 224)
+        return false;
+    *addr = in.s_addr;
+    return true;
+}
+
+static unsigned probe_targets(void)
+{
+    const struct host_stat *hosts = qosd_live_hosts();
+    time_t cutoff = time(NULL) - PROBE_ACTIVE_S;
+    unsigned n = 0, lan;
+
+    /* Leases/ARP give LAN hosts a MAC; remote conntrack peers have none */
+    for (int i = 0; i < MAX_HOSTS; i++) {
+        const struct host_stat *h = &hosts[i];
+        if (h->used && h->mac[0] && h->last_seen >= cutoff && parse_target(h->ip, &g_targets[n]))
+            n++;
+    }
+    lan = n;
+
+    const char *peers[PROBE_MAX_PEERS];
+    unsigned npeers = qosd_topk_destinations(peers, PROBE_MAX_PEERS);
+    for (unsigned i = 0; i < npeers; i++) {
+        uint32_t addr;
+        if (!parse_target(peers[i], &addr))
+            continue;
+
+        unsigned k;
+        for (k = 0; k < lan && g_targets[k] != addr; k++)
+            ;
+        if (k == lan)
+            g_targets[n++] = addr;
+    }
+    return n;
+}
+
+/* Returns false once the socket buffer is full */
+static bool probe_flush(struct mmsghdr *msgs, unsigned n)
+{
+    unsigned off = 0;
+
+    while (off < n) {
+        int sent = sendmmsg(g_fd.fd, msgs + off, n - off, 0);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        off += (unsigned)sent;
+    }
+    return true;
+}
+
+static void probe_send(void)
+{
+    static struct probe_packet pkts[PROBE_BATCH];
+    static struct sockaddr_in sins[PROBE_BATCH];
+    static struct iovec iovs[PROBE_BATCH];
+    static struct mmsghdr msgs[PROBE_BATCH];
+
+    unsigned ntargets = probe_targets();
+    if (!ntargets)
+        return;
+
+    unsigned count = ntargets < g_budget ? ntargets : g_budget;
+    unsigned n = 0;
+
+    g_round++;
+    for (unsigned i = 0; i < count; i++) {
+        uint32_t addr = g_targets[(g_cursor + i) % ntargets];
+        struct probe_entry *p = probe_claim(addr);
+
+        if (p->outstanding && ++p->misses >= PROBE_MAX_MISSES)
+            entry_set_rtt(p, 0);
+        p->outstanding = true;
+        p->round = g_round;
+
+        struct probe_packet *pkt = &pkts[n];
+        memset(pkt, 0, sizeof(*pkt));
+        pkt->hdr.type = ICMP_ECHO;
+        pkt->hdr.un.echo.id = htons(g_id);
+        pkt->hdr.un.echo.sequence = htons(g_seq++);
+        pkt->sent_usec = qosd_monotonic_usec();
+        pkt->magic = PROBE_MAGIC;
+        pkt->addr = addr;
+        pkt->hdr.checksum = icmp_checksum(pkt, sizeof(*pkt));
+
+        sins[n] = (struct sockaddr_in){ .sin_family = AF_INET, .sin_addr.s_addr = addr };
+        iovs[n] = (struct iovec){ .iov_base = pkt, .iov_len = sizeof(*pkt) };
+        msgs[n].msg_hdr = (struct msghdr){
+            .msg_name = &sins[n],
+            .msg_namelen = sizeof(sins[n]),
+            .msg_iov = &iovs[n],
+            .msg_iovlen = 1,
+        };
+
+        if (++n == PROBE_BATCH || i + 1 == count) {
+            if (!probe_flush(msgs, n))
+                break;
+            n = 0;
+        }
+    }
+
+    g_cursor = (g_cursor + count) % ntargets;
+}
+
+static void probe_reply(const uint8_t *buf, size_t len, const struct sockaddr_in *from)
+{
+    /* Raw sockets deliver the IP header, datagram sockets do not */
+    if (g_raw) {
+        if (len < 20)
+            return;
+        size_t ihl = (size_t)(buf[0] & 0x0f) * 4;
+        if (ihl < 20 || len < ihl)
+            return;
+        buf += ihl;
+        len -= ihl;
+    }
+
+    struct probe_packet pkt;
+    if (len < sizeof(pkt))
+        return;
+    memcpy(&pkt, buf, sizeof(pkt));
+
+    /* The kernel picks the id of datagram sockets and filters on it */
+    if (pkt.hdr.type != ICMP_ECHOREPLY || pkt.magic != PROBE_MAGIC ||
+        pkt.addr != from->sin_addr.s_addr || (g_raw && ntohs(pkt.hdr.un.echo.id) != g_id))
+        return;
+
+    uint64_t now = qosd_monotonic_usec();
+    if (pkt.sent_usec > now || now - pkt.sent_usec > PROBE_MAX_RTT_US)
+        return;
+
+    struct probe_entry *p = probe_find(pkt.addr);
+    if (!p)
+        return;
+
+    uint32_t rtt = (uint32_t)(now - pkt.sent_usec);
+    uint32_t ewma = p->rtt_us;
+    if (!rtt)
+        rtt = 1;
+    if (ewma)
+        ewma = (uint32_t)((int64_t)ewma + ((int64_t)rtt - ewma) / 8);
+    else
+        ewma = rtt;
+
+    entry_set_rtt(p, ewma ? ewma : 1);
+    p->misses = 0;
+    p->outstanding = false;
+}
+
+static void probe_fd_cb(struct uloop_fd *fd, unsigned int events)
+{
+    static uint8_t bufs[PROBE_BATCH][PROBE_BUF_LEN];
+    static struct sockaddr_in sins[PROBE_BATCH];
+    static struct iovec iovs[PROBE_BATCH];
+    static struct mmsghdr msgs[PROBE_BATCH];
+
+    (void)events;
+
+    for (;;) {
+        for (unsigned i = 0; i < PROBE_BATCH; i++) {
+            iovs[i] = (struct iovec){ .iov_base = bufs[i], .iov_len = PROBE_BUF_LEN };
+            msgs[i].msg_hdr = (struct msghdr){
+                .msg_name = &sins[i],
+                .msg_namelen = sizeof(sins[i]),
+                .msg_iov = &iovs[i],
+                .msg_iovlen = 1,
+            };
+        }
+
+        int n = recvmmsg(fd->fd, msgs, PROBE_BATCH, MSG_DONTWAIT, NULL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+
+        for (int i = 0; i < n; i++)
+            probe_reply(bufs[i], msgs[i].msg_len, &sins[i]);
+        if (n < PROBE_BATCH)
+            return;
+    }
+}
+
+static void probe_timer_cb(struct uloop_timeout *t)
+{
+    probe_send();
+    uloop_timeout_set(t, (int)g_interval * 1000);
+}
+
+static uint32_t lookup_us(const char *ip)
+{
+    uint32_t addr;
+    if (!ip || !parse_target(ip, &addr))
+        return 0;
+
+    const struct probe_entry *b = probe_bucket(addr);
+    for (unsigned i = 0; i < PROBE_WAYS; i++) {
+        if (__atomic_load_n(&b[i].addr, __ATOMIC_ACQUIRE) != addr)
+            continue;
+        uint32_t rtt = __atomic_load_n(&b[i].rtt_us, __ATOMIC_ACQUIRE);
+        return __atomic_load_n(&b[i].addr, __ATOMIC_RELAXED) == addr ? rtt : 0;
+    }
+    return 0;
+}
+
+/* EWMA RTT from the router to `ip` in microseconds, 0 if not measured */
+uint32_t qosd_probe_rtt_us(const char *ip)
+{
+    return g_table ? lookup_us(ip) : 0;
+}
+
+/*
+ * Latency of a forwarded flow as seen by the classifier: the router sits
+ * between both ends, so the legs add up. 0 when neither end is measured.
+ * Safe to call from ingest workers.
+ */
+uint32_t qosd_probe_path_ms(const char *src, const char *dst)
+{
+    if (!g_table)
+        return 0;
+
+    uint32_t us = lookup_us(src) + lookup_us(dst);
+    return us ? (us + 999) / 1000 : 0;
+}
+
+static int probe_socket(void)
+{
+    int fd = socket(AF_INET, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_ICMP);
+    if (fd >= 0) {
+        g_raw = true;
+        return fd;
+    }
+
+    g_raw = false;
+    return socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_ICMP);
+}
+
+/*
+ * interval: seconds between probe rounds, 0 disables probing.
+ * budget: echo requests per round.
+ * Call before the ingest pool starts, its workers read the table.
+ */
+int qosd_probe_init(unsigned interval, unsigned budget)
+{
+    if (!interval || !budget)
+        return 0;
+
+    int fd = probe_socket();
+    if (fd < 0) {
+        syslog(LOG_WARNING, "RTT probing disabled: %s", strerror(errno));
+        return -1;
+    }
+
+    g_table = calloc(PROBE_BUCKETS * PROBE_WAYS, sizeof(*g_table));
+    if (!g_table) {
+        close(fd);
+        return -1;
+    }
+
+    g_interval = interval;
+    g_budget = budget;
+    g_id = (uint16_t)getpid();
+
+    g_fd.fd = fd;
+    g_fd.cb = probe_fd_cb;
+    uloop_fd_add(&g_fd, ULOOP_READ);
+
+    g_timer.cb = probe_timer_cb;
+    uloop_timeout_set(&g_timer, (int)g_interval * 1000);
+    return 0;
+}
+
+void qosd_probe_done(void)
+{
+    uloop_timeout_cancel(&g_timer);
+    if (g_fd.fd >= 0) {
+        uloop_fd_delete(&g_fd);
+        close(g_fd.fd);
+        g_fd.fd = -1;
+    }
+
+    /* Ingest workers are already stopped */
+    free(g_table);
+    g_table = NULL;
+}
@@ -0,0 +1,771 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <libubox/uloop.h>
+#include <zlib.h>
+
+#include "qosd.h"
+
+/*
+ * Offline profiling: capture conntrack, lease and ARP snapshots on a
+ * router, then replay them through the sampling pipeline elsewhere.
+ *
+ * A capture is a gzip stream holding a header and one record per
+ * snapshot. Integers are little-endian so captures from big-endian MIPS
+ * routers replay on x86:
+ *
+ *   header  "QOSDCAP\0", u32 version, u32 reserved
+ *   record  u64 monotonic ms, i64 wall clock, u32 length of the conntrack,
+ *           leases and ARP contents, followed by the three contents
+ *
+ * The contents are the files as read, not a binary encoding of the parsed
+ * fields, so replay hands the parser exactly what the router produced.
+ * gzip shrinks conntrack text about tenfold, to some 20-25 bytes per
+ * entry and snapshot.
+ *
+ * Replay writes every snapshot into files in a private temp directory and
+ * points the live module at them, so the inline parser and the ingest
+ * pool run unchanged. The monotonic clock follows the recorded
+ * timestamps, which keeps rates identical at any speed; only the pacing
+ * between snapshots is divided by `speed`. Each interval reports the
+ * process CPU time and wall time of the pass, the allocations made by
+ * the whole process when run as qosd-replay (see qosd_alloc.c), how many
+ * host decisions changed since the previous interval and, against a
+ * baseline written by an earlier replay with -o, how many hosts differ.
+ */
+
+#define CAPTURE_MAGIC   "QOSDCAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_MAX_LEN (256u * 1024 * 1024)  /* Per file and snapshot */
+#define REPLAY_POLL_MS  1
+
+enum {
+    SNAP_NFCT,
+    SNAP_LEASES,
+    SNAP_ARP,
+    __SNAP_MAX
+};
+
+static const char *const snap_names[__SNAP_MAX] = { "nf_conntrack", "dhcp.leases", "arp" };
+
+struct snap_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+struct snapshot {
+    uint64_t mono_ms;
+    int64_t wall;
+    struct snap_buf file[__SNAP_MAX];
+};
+
+static uint64_t clock_usec(clockid_t id)
+{
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static void put_le64(uint8_t *p, uint64_t v)
+{
+    for (int i = 0; i < 8; i++)
+        p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    uint32_t v = 0;
+    for (int i = 3; i >= 0; i--)
+        v = v << 8 | p[i];
+    return v;
+}
+
+static uint64_t get_le64(const uint8_t *p)
+{
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--)
+        v = v << 8 | p[i];
+    return v;
+}
+
+static bool buf_reserve(struct snap_buf *b, size_t len)
+{
+    if (len <= b->cap)
+        return true;
+
+    size_t cap = b->cap ? b->cap : 64 * 1024;
+    while (cap < len)
+        cap *= 2;
+
+    char *data = realloc(b->data, cap);
+    if (!data)
+        return false;
+    b->data = data;
+    b->cap = cap;
+    return true;
+}
+
+static void snapshot_free(struct snapshot *s)
+{
+    for (int i = 0; i < __SNAP_MAX; i++)
+        free(s->file[i].data);
+    memset(s, 0, sizeof(*s));
+}
+
+/* procfs reports no size, so read until EOF; a missing file is empty */
+static bool read_file(const char *path, struct snap_buf *b)
+{
+    b->len = 0;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return true;
+
+    for (;;) {
+        if (b->len == CAPTURE_MAX_LEN || !buf_reserve(b, b->len + 16 * 1024)) {
+            close(fd);
+            return false;
+        }
+
+        size_t room = b->cap - b->len;
+        if (room > CAPTURE_MAX_LEN - b->len)
+            room = CAPTURE_MAX_LEN - b->len;
+
+        ssize_t r = read(fd, b->data + b->len, room);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0) {
+            close(fd);
+            return r == 0;
+        }
+        b->len += (size_t)r;
+    }
+}
+
+static bool write_file(const char *path, const struct snap_buf *b)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return false;
+
+    for (size_t off = 0; off < b->len; ) {
+        ssize_t w = write(fd, b->data + off, b->len - off);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0) {
+            close(fd);
+            return false;
+        }
+        off += (size_t)w;
+    }
+    return close(fd) == 0;
+}
+
+static bool gz_read_all(gzFile gz, void *buf, size_t len)
+{
+    return gzread(gz, buf, (unsigned)len) == (int)len;
+}
+
+static gzFile g_cap;
+static struct snapshot g_cap_snap;
+static unsigned g_cap_interval;
+static unsigned g_cap_limit;
+static unsigned g_cap_count;
+static const char *g_cap_paths[__SNAP_MAX];
+static struct uloop_timeout g_cap_timer;
+
+static bool capture_write(const struct snapshot *s)
+{
+    uint8_t hdr[28];
+
+    put_le64(hdr, s->mono_ms);
+    put_le64(hdr + 8, (uint64_t)s->wall);
+    for (int i = 0; i < __SNAP_MAX; i++)
+        put_le32(hdr + 16 + 4 * i, (uint32_t)s->file[i].len);
+
+    if (gzwrite(g_cap, hdr, sizeof(hdr)) != (int)sizeof(hdr))
+        return false;
+    for (int i = 0; i < __SNAP_MAX; i++) {
+        if (s->file[i].len && gzwrite(g_cap, s->file[i].data, (unsigned)s->file[i].len) != (int)s->file[i].len)
+            return false;
+    }
+    return true;
+}
+
+static void capture_timer_cb(struct uloop_timeout *t)
+{
+    struct snapshot *s = &g_cap_snap;
+
+    s->mono_ms = clock_usec(CLOCK_MONOTONIC) / 1000;
+    s->wall = time(NULL);
+    for (int i = 0; i < __SNAP_MAX; i++) {
+        if (!read_file(g_cap_paths[i], &s->file[i])) {
+            fprintf(stderr, "Failed to read %s\n", g_cap_paths[i]);
+            uloop_end();
+            return;
+        }
+    }
+
+    if (!capture_write(s)) {
+        fprintf(stderr, "Failed to write capture\n");
+        uloop_end();
+        return;
+    }
+
+    g_cap_count++;
+    fprintf(stderr, "snapshot %u: %zu bytes of conntrack\n", g_cap_count, s->file[SNAP_NFCT].len);
+
+    if (g_cap_limit && g_cap_count >= g_cap_limit)
+        uloop_end();
+    else
+        uloop_timeout_set(t, (int)g_cap_interval * 1000);
+}
+
+/*
+ * Records a snapshot every `interval` seconds into `path` until `count`
+ * snapshots are taken (0: until SIGINT/SIGTERM). Runs its own uloop.
+ */
+int qosd_capture_run(const char *path, unsigned interval, unsigned count)
+{
+    uint8_t hdr[16] = CAPTURE_MAGIC;
+
+    if (!interval)
+        interval = 1;
+
+    g_cap = gzopen(path, "wb6");
+    if (!g_cap) {
+        fprintf(stderr, "Failed to create %s\n", path);
+        return 1;
+    }
+
+    put_le32(hdr + 8, CAPTURE_VERSION);
+    if (gzwrite(g_cap, hdr, sizeof(hdr)) != (int)sizeof(hdr)) {
+        gzclose(g_cap);
+        return 1;
+    }
+
+    g_cap_paths[SNAP_NFCT] = qosd_live_nfct_path();
+    g_cap_paths[SNAP_LEASES] = qosd_live_leases_path();
+    g_cap_paths[SNAP_ARP] = qosd_live_arp_path();
+    g_cap_interval = interval;
+    g_cap_limit = count;
+    g_cap_timer.cb = capture_timer_cb;
+    uloop_timeout_set(&g_cap_timer, 0);
+
+    uloop_run();
+
+    uloop_timeout_cancel(&g_cap_timer);
+    snapshot_free(&g_cap_snap);
+    int ret = gzclose(g_cap) == Z_OK ? 0 : 1;
+    fprintf(stderr, "%u snapshots written to %s\n", g_cap_count, path);
+    return ret;
+}
+
+struct decision {
+    char ip[64];
+    char persona[32];
+    char priority[16];
+    char policy_action[32];
+    char dscp[16];
+};
+
+/* Baseline lines of one interval, sorted by IP as written */
+struct baseline {
+    char **lines;
+    unsigned *interval;
+    size_t n;
+    size_t pos;
+};
+
+static gzFile g_rep;
+static struct snapshot g_snap;
+static bool g_have_snap;
+static bool g_waiting;            /* Pass handed to the ingest pool */
+static unsigned g_speed;
+static char g_dir[64];
+static char g_paths[__SNAP_MAX][96];
+static struct uloop_timeout g_rep_timer;
+
+static bool g_started;
+static uint64_t g_first_mono_ms;
+static uint64_t g_real_start;
+static unsigned g_interval_no;
+static uint64_t g_pass_cpu;
+static uint64_t g_pass_wall;
+static uint64_t g_pass_allocs;
+static uint64_t g_pass_alloc_bytes;
+
+static FILE *g_out;
+static struct baseline g_base;
+static bool g_have_base;
+static struct decision g_prev[MAX_HOSTS];
+
+static struct json_writer g_jw;
+static char *g_lines;             /* Output of the current interval */
+static size_t g_lines_len;
+static size_t g_lines_cap;
+
+static struct {
+    unsigned intervals;
+    uint64_t cpu_us;
+    uint64_t cpu_us_max;
+    uint64_t allocs;
+    uint64_t changed;
+    uint64_t diffs;
+    uint64_t lag_ms_max;
+    bool failed;
+} g_total;
+
+static int replay_read(struct snapshot *s)
+{
+    uint8_t hdr[28];
+    int r = gzread(g_rep, hdr, sizeof(hdr));
+    if (r == 0)
+        return 0;
+    if (r != (int)sizeof(hdr))
+        return -1;
+
+    s->mono_ms = get_le64(hdr);
+    s->wall = (int64_t)get_le64(hdr + 8);
+    for (int i = 0; i < __SNAP_MAX; i++) {
+        struct snap_buf *b = &s->file[i];
+        b->len = get_le32(hdr + 16 + 4 * i);
+        if (b->len > CAPTURE_MAX_LEN || !buf_reserve(b, b->len + 1))
+            return -1;
+        if (b->len && !gz_read_all(g_rep, b->data, b->len))
+            return -1;
+    }
+    return 1;
+}
+
+static int cmp_host_ip(const void *a, const void *b)
+{
+    const struct host_stat *ha = *(const struct host_stat *const *)a;
+    const struct host_stat *hb = *(const struct host_stat *const *)b;
+    return strcmp(ha->ip, hb->ip);
+}
+
+static void lines_append(const char *s, size_t len)
+{
+    if (g_lines_len + len + 1 > g_lines_cap) {
+        size_t cap = g_lines_cap ? g_lines_cap : 64 * 1024;
+        while (cap < g_lines_len + len + 1)
+            cap *= 2;
+        char *p = realloc(g_lines, cap);
+        if (!p) {
+            g_total.failed = true;
+            return;
+        }
+        g_lines = p;
+        g_lines_cap = cap;
+    }
+    memcpy(g_lines + g_lines_len, s, len);
+    g_lines_len += len;
+    g_lines[g_lines_len] = '\0';
+}
+
+static bool decision_changed(const struct decision *d, const struct host_stat *h)
+{
+    return strcmp(d->ip, h->ip) || strcmp(d->persona, h->persona) ||
+           strcmp(d->priority, h->priority) || strcmp(d->policy_action, h->policy_action) ||
+           strcmp(d->dscp, h->dscp);
+}
+
+#define COPY_STR(dst, src) do { \
+        strncpy((dst), (src), sizeof(dst) - 1); \
+        (dst)[sizeof(dst) - 1] = '\0'; \
+    } while (0)
+
+/* One line per host, sorted by IP; returns how many decisions changed */
+static unsigned collect_output(unsigned *nhosts)
+{
+    static const struct host_stat *list[MAX_HOSTS];
+    const struct host_stat *hosts = qosd_live_hosts();
+    unsigned n = 0, changed = 0;
+
+    for (int i = 0; i < MAX_HOSTS; i++) {
+        const struct host_stat *h = &hosts[i];
+        if (!h->used)
+            continue;
+        list[n++] = h;
+
+        struct decision *d = &g_prev[i];
+        if (decision_changed(d, h)) {
+            if (d->ip[0] || h->persona[0])
+                changed++;
+            COPY_STR(d->ip, h->ip);
+            COPY_STR(d->persona, h->persona);
+            COPY_STR(d->priority, h->priority);
+            COPY_STR(d->policy_action, h->policy_action);
+            COPY_STR(d->dscp, h->dscp);
+        }
+    }
+    qsort(list, n, sizeof(list[0]), cmp_host_ip);
+
+    g_lines_len = 0;
+    for (unsigned i = 0; i < n; i++) {
+        const struct host_stat *h = list[i];
+        char line[512];
+        int len = snprintf(line, sizeof(line), "%s\t%s\t%s\t%s\t%s\t%u\t%llu\t%llu\n",
+                           h->ip, h->persona[0] ? h->persona : "-",
+                           h->priority[0] ? h->priority : "-",
+                           h->policy_action[0] ? h->policy_action : "-",
+                           h->dscp[0] ? h->dscp : "-", h->confidence,
+                           (unsigned long long)h->rx_bps, (unsigned long long)h->tx_bps);
+        if (len > 0)
+            lines_append(line, (size_t)len < sizeof(line) ? (size_t)len : sizeof(line) - 1);
+    }
+
+    *nhosts = n;
+    return changed;
+}
+
+static int cmp_line_ip(const char *a, const char *b)
+{
+    size_t la = strcspn(a, "\t\n"), lb = strcspn(b, "\t\n");
+    int c = memcmp(a, b, la < lb ? la : lb);
+    return c ? c : (la < lb ? -1 : (la > lb ? 1 : 0));
+}
+
+static bool line_equal(const char *a, const char *b)
+{
+    size_t la = strcspn(a, "\n"), lb = strcspn(b, "\n");
+    return la == lb && !memcmp(a, b, la);
+}
+
+static void print_diff(char sign, const char *line)
+{
+    fprintf(stderr, "interval %u: %c %.*s\n", g_interval_no, sign, (int)strcspn(line, "\n"), line);
+}
+
+/* Merges this interval's lines with the baseline's; returns differing hosts */
+static unsigned diff_baseline(void)
+{
+    struct baseline *b = &g_base;
+    unsigned diffs = 0;
+
+    while (b->pos < b->n && b->interval[b->pos] < g_interval_no)
+        b->pos++;
+
+    const char *cur = g_lines;
+    const char *end = g_lines + g_lines_len;
+    while (cur < end || (b->pos < b->n && b->interval[b->pos] == g_interval_no)) {
+        const char *base = (b->pos < b->n && b->interval[b->pos] == g_interval_no) ? b->lines[b->pos] : NULL;
+        int c = !base ? -1 : (cur >= end ? 1 : cmp_line_ip(cur, base));
+
+        if (c < 0) {
+            print_diff('+', cur);
+            diffs++;
+        } else if (c > 0) {
+            print_diff('-', base);
+            diffs++;
+        } else if (!line_equal(cur, base)) {
+            print_diff('-', base);
+            print_diff('+', cur);
+            diffs++;
+        }
+
+        if (c <= 0)
+            cur += strcspn(cur, "\n") + 1;
+        if (c >= 0)
+            b->pos++;
+    }
+    return diffs;
+}
+
+static void write_output(void)
+{
+    const char *p = g_lines;
+    const char *end = g_lines + g_lines_len;
+
+    while (p < end) {
+        size_t len = strcspn(p, "\n") + 1;
+        fprintf(g_out, "%u\t%.*s", g_interval_no, (int)len, p);
+        p += len;
+    }
+}
+
+static void report_interval(void)
+{
+    unsigned nhosts;
+    unsigned changed = collect_output(&nhosts);
+    unsigned diffs = g_have_base ? diff_baseline() : 0;
+
+    if (g_out)
+        write_output();
+
+    json_begin(&g_jw);
+    json_add_string(&g_jw, "event", "qosd_replay_interval");
+    json_add_u64(&g_jw, "interval", g_interval_no);
+    json_add_u64(&g_jw, "t_ms", g_snap.mono_ms - g_first_mono_ms);
+    json_add_u64(&g_jw, "lines", qosd_stats.conntrack_lines);
+    json_add_u64(&g_jw, "hosts", nhosts);
+    json_add_u64(&g_jw, "cpu_us", g_pass_cpu);
+    json_add_u64(&g_jw, "wall_us", g_pass_wall);
+    if (qosd_alloc_stats) {
+        json_add_u64(&g_jw, "allocs", g_pass_allocs);
+        json_add_u64(&g_jw, "alloc_bytes", g_pass_alloc_bytes);
+    }
+    json_add_u64(&g_jw, "changed", changed);
+    if (g_have_base)
+        json_add_u64(&g_jw, "diffs", diffs);
+
+    const char *payload = json_end(&g_jw);
+    if (payload)
+        printf("%s\n", payload);
+
+    g_total.intervals++;
+    g_total.cpu_us += g_pass_cpu;
+    if (g_pass_cpu > g_total.cpu_us_max)
+        g_total.cpu_us_max = g_pass_cpu;
+    g_total.allocs += g_pass_allocs;
+    g_total.changed += changed;
+    g_total.diffs += diffs;
+}
+
+static uint64_t g_mark_cpu, g_mark_wall;
+static uint32_t g_mark_allocs, g_mark_alloc_bytes;
+
+static void pass_begin(void)
+{
+    g_mark_cpu = clock_usec(CLOCK_PROCESS_CPUTIME_ID);
+    g_mark_wall = clock_usec(CLOCK_MONOTONIC);
+    if (qosd_alloc_stats)
+        qosd_alloc_stats(&g_mark_allocs, &g_mark_alloc_bytes);
+}
+
+static void pass_end(void)
+{
+    g_pass_cpu = clock_usec(CLOCK_PROCESS_CPUTIME_ID) - g_mark_cpu;
+    g_pass_wall = clock_usec(CLOCK_MONOTONIC) - g_mark_wall;
+    if (qosd_alloc_stats) {
+        uint32_t allocs, bytes;
+        qosd_alloc_stats(&allocs, &bytes);
+        g_pass_allocs = (uint32_t)(allocs - g_mark_allocs);
+        g_pass_alloc_bytes = (uint32_t)(bytes - g_mark_alloc_bytes);
+    }
+
+    g_interval_no++;
+    report_interval();
+}
+
+static void replay_timer_cb(struct uloop_timeout *t)
+{
+    if (g_waiting) {
+        if (qosd_ingest_busy()) {
+            uloop_timeout_set(t, REPLAY_POLL_MS);
+            return;
+        }
+        g_waiting = false;
+        pass_end();
+    }
+
+    if (!g_have_snap) {
+        int r = replay_read(&g_snap);
+        if (r <= 0) {
+            if (r < 0) {
+                fprintf(stderr, "Truncated or corrupt capture\n");
+                g_total.failed = true;
+            }
+            uloop_end();
+            return;
+        }
+        if (!g_started) {
+            g_first_mono_ms = g_snap.mono_ms;
+            g_started = true;
+        }
+        g_have_snap = true;
+    }
+
+    /* Pace recorded time by `speed` */
+    uint64_t due = g_real_start + (g_snap.mono_ms - g_first_mono_ms) * 1000 / g_speed;
+    uint64_t now = clock_usec(CLOCK_MONOTONIC);
+    if (now < due) {
+        uloop_timeout_set(t, (int)((due - now + 999) / 1000));
+        return;
+    }
+    if ((now - due) / 1000 > g_total.lag_ms_max)
+        g_total.lag_ms_max = (now - due) / 1000;
+
+    for (int i = 0; i < __SNAP_MAX; i++) {
+        if (!write_file(g_paths[i], &g_snap.file[i])) {
+            fprintf(stderr, "Failed to write %s\n", g_paths[i]);
+            g_total.failed = true;
+            uloop_end();
+            return;
+        }
+    }
+    g_have_snap = false;
+
+    /* +1 so that a capture starting at 0 ms never selects the real clock */
+    qosd_live_set_clock((g_snap.mono_ms + 1) * 1000);
+    pass_begin();
+    if (qosd_live_refresh()) {
+        pass_end();
+        uloop_timeout_set(t, 0);
+    } else {
+        g_waiting = true;
+        uloop_timeout_set(t, REPLAY_POLL_MS);
+    }
+}
+
+static bool baseline_load(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return false;
+
+    char *line = NULL;
+    size_t cap = 0, alloc = 0;
+    ssize_t len;
+
+    while ((len = getline(&line, &cap, f)) > 0) {
+        char *tab;
+        unsigned long iv = strtoul(line, &tab, 10);
+        if (*tab != '\t')
+            continue;
+
+        if (g_base.n == alloc) {
+            alloc = alloc ? alloc * 2 : 1024;
+            char **lines = realloc(g_base.lines, alloc * sizeof(*lines));
+            unsigned *ivs = lines ? realloc(g_base.interval, alloc * sizeof(*ivs)) : NULL;
+            if (lines)
+                g_base.lines = lines;
+            if (!ivs)
+                break;
+            g_base.interval = ivs;
+        }
+
+        g_base.lines[g_base.n] = strdup(tab + 1);
+        if (!g_base.lines[g_base.n])
+            break;
+        g_base.interval[g_base.n++] = (unsigned)iv;
+    }
+
+    free(line);
+    bool ok = !ferror(f) && feof(f);
+    fclose(f);
+    return ok;
+}
+
+static void replay_cleanup(void)
+{
+    for (int i = 0; i < __SNAP_MAX; i++) {
+        if (g_paths[i][0])
+            unlink(g_paths[i]);
+    }
+    if (g_dir[0])
+        rmdir(g_dir);
+
+    for (size_t i = 0; i < g_base.n; i++)
+        free(g_base.lines[i]);
+    free(g_base.lines);
+    free(g_base.interval);
+    memset(&g_base, 0, sizeof(g_base));
+
+    snapshot_free(&g_snap);
+    free(g_lines);
+    g_lines = NULL;
+    g_lines_len = g_lines_cap = 0;
+    json_free(&g_jw);
+}
+
+/*
+ * Feeds the capture at `path` through the sampling pipeline at `speed`
+ * (1-1000) times recorded pace. `out` receives the per-host output of
+ * every interval, which a later run can compare against as `baseline`.
+ * Both may be NULL. Returns 0, 2 when the output differs from the
+ * baseline, or 1 on errors. Runs its own uloop; the ingest pool and the
+ * top-k sketches are used when they were initialized.
+ */
+int qosd_replay_run(const char *path, unsigned speed, const char *out, const char *baseline)
+{
+    uint8_t hdr[16];
+    int ret = 1;
+
+    g_speed = speed < 1 ? 1 : (speed > 1000 ? 1000 : speed);
+
+    g_rep = gzopen(path, "rb");
+    if (!g_rep) {
+        fprintf(stderr, "Failed to open %s\n", path);
+        return 1;
+    }
+    if (!gz_read_all(g_rep, hdr, sizeof(hdr)) || memcmp(hdr, CAPTURE_MAGIC, 8) ||
+        get_le32(hdr + 8) != CAPTURE_VERSION) {
+        fprintf(stderr, "%s is not a qosd capture\n", path);
+        goto out;
+    }
+
+    if (baseline) {
+        if (!baseline_load(baseline)) {
+            fprintf(stderr, "Failed to read baseline %s\n", baseline);
+            goto out;
+        }
+        g_have_base = true;
+    }
+
+    if (out && !(g_out = fopen(out, "w"))) {
+        fprintf(stderr, "Failed to create %s\n", out);
+        goto out;
+    }
+
+    const char *tmp = getenv("TMPDIR");
+    snprintf(g_dir, sizeof(g_dir), "%s/qosd-replay.XXXXXX", tmp && strlen(tmp) < 32 ? tmp : "/tmp");
+    if (!mkdtemp(g_dir)) {
+        fprintf(stderr, "Failed to create %s\n", g_dir);
+        g_dir[0] = '\0';
+        goto out;
+    }
+    for (int i = 0; i < __SNAP_MAX; i++)
+        snprintf(g_paths[i], sizeof(g_paths[i]), "%s/%s", g_dir, snap_names[i]);
+    qosd_live_set_paths(g_paths[SNAP_NFCT], g_paths[SNAP_LEASES], g_paths[SNAP_ARP]);
+
+    g_real_start = clock_usec(CLOCK_MONOTONIC);
+    g_rep_timer.cb = replay_timer_cb;
+    uloop_timeout_set(&g_rep_timer, 0);
+
+    uloop_run();
+
+    uloop_timeout_cancel(&g_rep_timer);
+    qosd_live_set_clock(0);
+
+    json_begin(&g_jw);
+    json_add_string(&g_jw, "event", "qosd_replay_summary");
+    json_add_u64(&g_jw, "intervals", g_total.intervals);
+    json_add_u64(&g_jw, "speed", g_speed);
+    json_add_u64(&g_jw, "cpu_us", g_total.cpu_us);
+    json_add_u64(&g_jw, "cpu_us_max", g_total.cpu_us_max);
+    if (qosd_alloc_stats)
+        json_add_u64(&g_jw, "allocs", g_total.allocs);
+    json_add_u64(&g_jw, "changed", g_total.changed);
+    if (g_have_base)
+        json_add_u64(&g_jw, "diffs", g_total.diffs);
+    json_add_u64(&g_jw, "lag_ms_max", g_total.lag_ms_max);
+    const char *payload = json_end(&g_jw);
+    if (payload)
+        printf("%s\n", payload);
+
+    ret = g_total.failed ? 1 : (g_total.diffs ? 2 : 0);
+
+out:
+    if (g_out && fclose(g_out))
+        ret = 1;
+    g_out = NULL;
+    gzclose(g_rep);
+    replay_cleanup();
+    return ret;
+}
@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libubox/uloop.h>
+#include <syslog.h>
+
+#include "qosd.h"
+#include "qosd_shm.h"
+
+/*
+ * Host table published in shared memory for local readers that should
+ * not go through ubusd (rpcd, scripts, monitoring agents). The layout and
+ * the reader side live in qosd_shm.h; this is the single writer.
+ *
+ * The region is sized for MAX_HOSTS records once at startup and every
+ * update rewrites the active hosts under the header's sequence lock.
+ */
+
+static char g_name[64];
+static struct qosd_shm_header *g_hdr;
+static size_t g_len;
+static unsigned g_interval;
+static struct uloop_timeout g_timer;
+
+static inline struct qosd_shm_host *shm_record(unsigned i)
+{
+    return (struct qosd_shm_host *)((char *)g_hdr + sizeof(*g_hdr)) + i;
+}
+
+static int cmp_bps_desc(const void *a, const void *b)
+{
+    const struct host_stat *ha = *(const struct host_stat *const *)a;
+    const struct host_stat *hb = *(const struct host_stat *const *)b;
+    uint64_t aa = ha->rx_bps + ha->tx_bps;
+    uint64_t bb = hb->rx_bps + hb->tx_bps;
+    return (aa < bb) ? 1 : (aa > bb ? -1 : 0);
+}
+
+#define COPY_STR(dst, src) do { \
+        strncpy((dst), (src), sizeof(dst) - 1); \
+        (dst)[sizeof(dst) - 1] = '\0'; \
+    } while (0)
+
+static void shm_write_begin(void)
+{
+    __atomic_store_n(&g_hdr->seq, g_hdr->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void shm_write_end(void)
+{
+    __atomic_store_n(&g_hdr->seq, g_hdr->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Called after every rate computation with the live host table */
+void qosd_shm_publish(const struct host_stat *hosts)
+{
+    static const struct host_stat *list[MAX_HOSTS];
+    unsigned n = 0;
+
+    if (!g_hdr)
+        return;
+
+    for (int i = 0; i < MAX_HOSTS; i++) {
+        if (hosts[i].used)
+            list[n++] = &hosts[i];
+    }
+    qsort(list, n, sizeof(list[0]), cmp_bps_desc);
+
+    /* Sorting and the RTT lookups stay outside the write section */
+    uint32_t rtt[MAX_HOSTS];
+    for (unsigned i = 0; i < n; i++)
+        rtt[i] = qosd_probe_rtt_us(list[i]->ip);
+
+    shm_write_begin();
+    for (unsigned i = 0; i < n; i++) {
+        const struct host_stat *h = list[i];
+        struct qosd_shm_host *r = shm_record(i);
+
+        COPY_STR(r->ip, h->ip);
+        COPY_STR(r->mac, h->mac);
+        COPY_STR(r->hostname, h->hostname);
+        COPY_STR(r->persona, h->persona);
+        COPY_STR(r->priority, h->priority);
+        COPY_STR(r->policy_action, h->policy_action);
+        COPY_STR(r->dscp, h->dscp);
+        r->rx_bps = h->rx_bps;
+        r->tx_bps = h->tx_bps;
+        r->rx_bytes_total = h->rx_bytes_total;
+        r->tx_bytes_total = h->tx_bytes_total;
+        r->last_seen = h->last_seen;
+        r->rtt_us = rtt[i];
+        r->confidence = h->confidence;
+    }
+    g_hdr->count = n;
+    g_hdr->updated_wall = time(NULL);
+    g_hdr->updated_mono_ms = qosd_monotonic_usec() / 1000;
+    shm_write_end();
+}
+
+/* Readers only see what callers sampled otherwise, keep it fresh */
+static void shm_timer_cb(struct uloop_timeout *t)
+{
+    qosd_live_refresh();
+    uloop_timeout_set(t, (int)g_interval * 1000);
+}
+
+/*
+ * name: shm_open() name, e.g. QOSD_SHM_NAME.
+ * interval: seconds between samples taken by the daemon itself.
+ */
+int qosd_shm_init(const char *name, unsigned interval)
+{
+    if (!name || name[0] != '/' || strlen(name) >= sizeof(g_name) || !interval)
+        return -1;
+
+    size_t len = sizeof(struct qosd_shm_header) + (size_t)MAX_HOSTS * sizeof(struct qosd_shm_host);
+
+    /* A leftover region from an earlier run may have another size */
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        syslog(LOG_WARNING, "shm_open %s: %s", name, strerror(errno));
+        return -1;
+    }
+
+    if (ftruncate(fd, (off_t)len)) {
+        syslog(LOG_WARNING, "ftruncate %s: %s", name, strerror(errno));
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        shm_unlink(name);
+        return -1;
+    }
+
+    g_hdr = p;
+    g_len = len;
+    strcpy(g_name, name);
+
+    /* ftruncate() zeroed the region; seq starts even with no records */
+    g_hdr->version = QOSD_SHM_VERSION;
+    g_hdr->header_size = sizeof(*g_hdr);
+    g_hdr->record_size = sizeof(struct qosd_shm_host);
+    g_hdr->capacity = MAX_HOSTS;
+    g_hdr->pid = (uint32_t)getpid();
+    __atomic_store_n(&g_hdr->magic, QOSD_SHM_MAGIC, __ATOMIC_RELEASE);
+
+    g_interval = interval;
+    g_timer.cb = shm_timer_cb;
+    uloop_timeout_set(&g_timer, (int)g_interval * 1000);
+    return 0;
+}
+
+void qosd_shm_done(void)
+{
+    uloop_timeout_cancel(&g_timer);
+    if (!g_hdr)
+        return;
+
+    /* Readers still holding the mapping get ESTALE */
+    shm_write_begin();
+    g_hdr->magic = 0;
+    g_hdr->count = 0;
+    shm_write_end();
+
+    munmap(g_hdr, g_len);
+    shm_unlink(g_name);
+    g_hdr = NULL;
+    g_len = 0;
+}
@@ -0,0 +1,266 @@
+#pragma once
+
+/*
+ * Read-only view of the qosd host table in POSIX shared memory.
+ *
+ * This header is the whole reader library: include it, call
+ * qosd_shm_open() once and qosd_shm_snapshot() as often as needed. A
+ * snapshot takes no lock and makes no system call unless it has to wait
+ * out an update, so readers cannot stall the daemon.
+ *
+ * Layout of the region (native byte order, it never leaves the router):
+ *
+ *   offset 0             struct qosd_shm_header
+ *   offset header_size   capacity x struct qosd_shm_host, record_size apart
+ *
+ * The first `count` records are valid, sorted by rx_bps + tx_bps,
+ * highest first. The daemon rewrites them after every conntrack pass
+ * under a sequence lock: `seq` is odd while an update is in progress and
+ * grows by two per update, so seq / 2 is the generation. A reader copies
+ * the records between two reads of an even and unchanged `seq`.
+ *
+ * Records may grow at the tail in later versions, readers rely on
+ * record_size; a different `version` is an incompatible layout. When the
+ * daemon exits it clears `magic` and removes the name, and readers must
+ * reopen once it is back. A daemon that crashed clears nothing, so a
+ * reader whose generation stops advancing calls qosd_shm_check(): the
+ * region is stale once its writer `pid` is gone or the name refers to a
+ * newer region.
+ *
+ * Every field is at most 32 bits wide where atomicity matters, so 32-bit
+ * readers need no libatomic, whose locks would not be shared with the
+ * daemon anyway.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define QOSD_SHM_NAME    "/qosd"
+#define QOSD_SHM_MAGIC   0x4d485351u   /* "QSHM" */
+#define QOSD_SHM_VERSION 2
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct qosd_shm_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t record_size;
+    uint32_t capacity;          /* Records the region has room for */
+    uint32_t count;             /* Valid records, guarded by seq */
+    uint32_t seq;               /* Odd while the daemon writes */
+    uint32_t pid;               /* Writer */
+    int64_t updated_wall;       /* time(NULL) of the last update */
+    uint64_t updated_mono_ms;   /* CLOCK_MONOTONIC of the last update */
+    uint32_t reserved[4];
+};
+
+struct qosd_shm_host {
+    char ip[64];
+    char mac[32];
+    char hostname[64];
+    char persona[32];
+    char priority[16];
+    char policy_action[32];
+    char dscp[16];
+    uint64_t rx_bps;
+    uint64_t tx_bps;
+    uint64_t rx_bytes_total;
+    uint64_t tx_bytes_total;
+    int64_t last_seen;
+    uint32_t rtt_us;            /* 0 if not measured */
+    uint8_t confidence;
+    uint8_t pad[3];
+};
+
+#ifndef __cplusplus
+_Static_assert(sizeof(struct qosd_shm_header) == 64, "shm header layout changed");
+_Static_assert(sizeof(struct qosd_shm_host) == 304, "shm record layout changed");
+#endif
+
+#define QOSD_SHM_RETRIES 64
+
+struct qosd_shm_reader {
+    const volatile struct qosd_shm_header *hdr;
+    size_t len;
+    dev_t dev;                  /* Identify the region behind the name */
+    ino_t ino;
+};
+
+/* Generation and update time of the copy returned by a snapshot */
+struct qosd_shm_info {
+    uint64_t generation;
+    int64_t updated_wall;
+    uint64_t updated_mono_ms;
+};
+
+static inline void qosd_shm_close(struct qosd_shm_reader *r)
+{
+    if (r->hdr)
+        munmap((void *)r->hdr, r->len);
+    r->hdr = NULL;
+    r->len = 0;
+}
+
+/* Whether the writer of `h` is gone; pid 0 and EPERM count as alive */
+static inline int qosd_shm_writer_gone(const volatile struct qosd_shm_header *h)
+{
+    pid_t pid = (pid_t)h->pid;
+    return pid > 0 && kill(pid, 0) && errno == ESRCH;
+}
+
+/*
+ * name: NULL for QOSD_SHM_NAME. Returns 0, or -1 with errno set: ESTALE
+ * for the region of a daemon that crashed and has not been restarted.
+ */
+static inline int qosd_shm_open(struct qosd_shm_reader *r, const char *name)
+{
+    struct stat st;
+    int fd = shm_open(name ? name : QOSD_SHM_NAME, O_RDONLY, 0);
+
+    r->hdr = NULL;
+    r->len = 0;
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(struct qosd_shm_header)) {
+        close(fd);
+        errno = EPROTO;
+        return -1;
+    }
+
+    void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return -1;
+
+    const struct qosd_shm_header *h = (const struct qosd_shm_header *)p;
+    if (h->magic != QOSD_SHM_MAGIC || h->version != QOSD_SHM_VERSION ||
+        h->header_size < sizeof(*h) ||
+        (size_t)h->header_size + (size_t)h->capacity * h->record_size > (size_t)st.st_size) {
+        munmap(p, (size_t)st.st_size);
+        errno = EPROTO;
+        return -1;
+    }
+    if (qosd_shm_writer_gone(h)) {
+        munmap(p, (size_t)st.st_size);
+        errno = ESTALE;
+        return -1;
+    }
+
+    r->hdr = (const volatile struct qosd_shm_header *)p;
+    r->len = (size_t)st.st_size;
+    r->dev = st.st_dev;
+    r->ino = st.st_ino;
+    return 0;
+}
+
+/*
+ * Whether the open region is still the live one: its writer runs and
+ * `name` (NULL for QOSD_SHM_NAME) still refers to it. Costs a few system
+ * calls, so call it when the generation stops advancing rather than
+ * before every snapshot. Returns 0, or -1 with errno ESTALE (reopen) or
+ * the error of the check.
+ */
+static inline int qosd_shm_check(const struct qosd_shm_reader *r, const char *name)
+{
+    struct stat st;
+    int fd = shm_open(name ? name : QOSD_SHM_NAME, O_RDONLY, 0);
+
+    if (fd < 0) {
+        if (errno == ENOENT)
+            errno = ESTALE;
+        return -1;
+    }
+    int ret = fstat(fd, &st);
+    close(fd);
+    if (ret)
+        return -1;
+
+    if (st.st_dev != r->dev || st.st_ino != r->ino ||
+        r->hdr->magic != QOSD_SHM_MAGIC || qosd_shm_writer_gone(r->hdr)) {
+        errno = ESTALE;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Copies up to `max` records into `out` and returns how many, or -1 with
+ * errno EAGAIN (the daemon kept writing) or ESTALE (the daemon exited,
+ * reopen). `info` may be NULL.
+ */
+static inline int qosd_shm_snapshot(const struct qosd_shm_reader *r, struct qosd_shm_host *out,
+                                    unsigned max, struct qosd_shm_info *info)
+{
+    const volatile struct qosd_shm_header *h = r->hdr;
+    const char *base = (const char *)h;
+
+    for (int tries = 0; tries < QOSD_SHM_RETRIES; tries++) {
+        uint32_t seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();   /* Let a preempted writer finish on one core */
+            continue;
+        }
+
+        if (h->magic != QOSD_SHM_MAGIC) {
+            errno = ESTALE;
+            return -1;
+        }
+
+        uint32_t rsize = h->record_size;
+        uint32_t count = h->count;
+        if (count > h->capacity)
+            count = h->capacity;
+        if (count > max)
+            count = max;
+
+        size_t copy = rsize < sizeof(*out) ? rsize : sizeof(*out);
+        for (uint32_t i = 0; i < count; i++) {
+            memcpy(&out[i], base + h->header_size + (size_t)i * rsize, copy);
+            if (copy < sizeof(*out))
+                memset((char *)&out[i] + copy, 0, sizeof(*out) - copy);
+        }
+
+        struct qosd_shm_info meta;
+        meta.generation = seq / 2;
+        meta.updated_wall = h->updated_wall;
+        meta.updated_mono_ms = h->updated_mono_ms;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&h->seq, __ATOMIC_RELAXED) != seq) {
+            sched_yield();
+            continue;
+        }
+
+        for (uint32_t i = 0; i < count; i++) {
+            out[i].ip[sizeof(out[i].ip) - 1] = '\0';
+            out[i].mac[sizeof(out[i].mac) - 1] = '\0';
+            out[i].hostname[sizeof(out[i].hostname) - 1] = '\0';
+            out[i].persona[sizeof(out[i].persona) - 1] = '\0';
+            out[i].priority[sizeof(out[i].priority) - 1] = '\0';
+            out[i].policy_action[sizeof(out[i].policy_action) - 1] = '\0';
+            out[i].dscp[sizeof(out[i].dscp) - 1] = '\0';
+        }
+        if (info)
+            *info = meta;
+        return (int)count;
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "qosd_shm.h"
+
+/*
+ * qosd-shm: prints the host table qosd publishes in shared memory,
+ * without going through ubus. Also serves as the reference reader.
+ */
+
+static struct qosd_shm_host *g_hosts;
+static unsigned g_capacity;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -N <name>        Shared memory name (default " QOSD_SHM_NAME ")\n"
+            "  -n <limit>       Print at most <limit> hosts\n"
+            "  -j               One JSON object per line\n"
+            "  -w <seconds>     Keep printing every new generation\n",
+            prog);
+}
+
+static void print_json_string(const char *key, const char *val)
+{
+    printf("\"%s\":\"", key);
+    for (const unsigned char *p = (const unsigned char *)val; *p; p++) {
+        if (*p == '"' || *p == '\\')
+            printf("\\%c", *p);
+        else if (*p < 0x20)
+            printf("\\u%04x", *p);
+        else
+            putchar(*p);
+    }
+    printf("\",");
+}
+
+static void print_json(const struct qosd_shm_host *h, const struct qosd_shm_info *info)
+{
+    putchar('{');
+    printf("\"generation\":%llu,\"updated\":%lld,",
+           (unsigned long long)info->generation, (long long)info->updated_wall);
+    print_json_string("ip", h->ip);
+    print_json_string("mac", h->mac);
+    print_json_string("hostname", h->hostname);
+    print_json_string("persona", h->persona);
+    print_json_string("priority", h->priority);
+    print_json_string("policy_action", h->policy_action);
+    print_json_string("dscp", h->dscp);
+    printf("\"rx_bps\":%llu,\"tx_bps\":%llu,\"rx_bytes\":%llu,\"tx_bytes\":%llu,"
+           "\"last_seen\":%lld,\"rtt_us\":%u,\"confidence\":%u}\n",
+           (unsigned long long)h->rx_bps, (unsigned long long)h->tx_bps,
+           (unsigned long long)h->rx_bytes_total, (unsigned long long)h->tx_bytes_total,
+           (long long)h->last_seen, h->rtt_us, h->confidence);
+}
+
+static void print_table(const struct qosd_shm_host *hosts, int n, const struct qosd_shm_info *info)
+{
+    printf("# generation %llu, updated %lld\n",
+           (unsigned long long)info->generation, (long long)info->updated_wall);
+    printf("%-39s %-17s %-20s %-12s %-8s %12s %12s %8s\n",
+           "IP", "MAC", "HOSTNAME", "PERSONA", "PRIO", "RX_BPS", "TX_BPS", "RTT_US");
+    for (int i = 0; i < n; i++) {
+        const struct qosd_shm_host *h = &hosts[i];
+        printf("%-39s %-17s %-20s %-12s %-8s %12llu %12llu %8u\n",
+               h->ip, h->mac[0] ? h->mac : "-", h->hostname[0] ? h->hostname : "-",
+               h->persona[0] ? h->persona : "-", h->priority[0] ? h->priority : "-",
+               (unsigned long long)h->rx_bps, (unsigned long long)h->tx_bps, h->rtt_us);
+    }
+}
+
+/* Opens the region and sizes the copy buffer for it */
+static int shm_open_hosts(struct qosd_shm_reader *r, const char *name)
+{
+    if (qosd_shm_open(r, name))
+        return -1;
+
+    unsigned capacity = r->hdr->capacity;
+    if (capacity > g_capacity) {
+        struct qosd_shm_host *hosts = realloc(g_hosts, (size_t)capacity * sizeof(*hosts));
+        if (!hosts) {
+            qosd_shm_close(r);
+            errno = ENOMEM;
+            return -1;
+        }
+        g_hosts = hosts;
+        g_capacity = capacity;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *name = QOSD_SHM_NAME;
+    unsigned limit = 0;
+    unsigned watch = 0;
+    bool json = false;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "N:n:jw:h")) != -1) {
+        switch (ch) {
+        case 'N':
+            name = optarg;
+            break;
+        case 'n':
+            limit = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        case 'j':
+            json = true;
+            break;
+        case 'w':
+            watch = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return ch == 'h' ? 0 : 1;
+        }
+    }
+
+    struct qosd_shm_reader r;
+    if (shm_open_hosts(&r, name)) {
+        fprintf(stderr, "%s: %s\n", name, strerror(errno));
+        return 1;
+    }
+
+    uint64_t last = UINT64_MAX;
+    for (;;) {
+        struct qosd_shm_info info;
+        unsigned max = limit && limit < g_capacity ? limit : g_capacity;
+        int n = qosd_shm_snapshot(&r, g_hosts, max, &info);
+
+        /* No new generation: the daemon may have crashed or been replaced */
+        if (n >= 0 && watch && info.generation == last && qosd_shm_check(&r, name) && errno == ESTALE)
+            n = -1;
+
+        /* The daemon restarted: wait for its new region */
+        if (n < 0 && errno == ESTALE && watch) {
+            qosd_shm_close(&r);
+            while (shm_open_hosts(&r, name))
+                sleep(watch);
+            last = UINT64_MAX;
+            continue;
+        }
+        if (n < 0) {
+            fprintf(stderr, "%s: %s\n", name, strerror(errno));
+            qosd_shm_close(&r);
+            return 1;
+        }
+
+        if (info.generation != last) {
+            last = info.generation;
+            if (json) {
+                for (int i = 0; i < n; i++)
+                    print_json(&g_hosts[i], &info);
+            } else {
+                print_table(g_hosts, n, &info);
+            }
+            fflush(stdout);
+        }
+
+        if (!watch)
+            break;
+        sleep(watch);
+    }
+
+    qosd_shm_close(&r);
+    free(g_hosts);
+    return 0;
+}
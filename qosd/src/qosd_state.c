@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libubox/uloop.h>
+#include <syslog.h>
+#include <zlib.h>
+
+#include "qosd.h"
+
+/*
+ * Host table snapshot for warm restarts.
+ *
+ * The file is a fixed header followed by `count` fixed-size records, in
+ * native byte order (it never leaves the router). Records may grow at the
+ * tail in later versions: readers copy min(record_size, sizeof(ours)) and
+ * zero the rest, while a different `version` means an incompatible layout
+ * and the snapshot is ignored.
+ *
+ * Monotonic timestamps are only meaningful within one boot, so they are
+ * trusted only when the stored boot id matches the running kernel's.
+ */
+
+#define STATE_MAGIC   "QOSDSTAT"
+#define STATE_VERSION 1
+#define BOOT_ID_FILE  "/proc/sys/kernel/random/boot_id"
+
+struct state_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t record_size;
+    uint32_t count;
+    char boot_id[40];
+    int64_t saved_wall;      /* time(NULL) at save */
+    uint64_t saved_mono_ms;  /* CLOCK_MONOTONIC at save */
+    uint64_t prev_tick_ms;   /* CLOCK_MONOTONIC of the last rate computation */
+    uint32_t crc;            /* crc32 over all records */
+    uint32_t reserved;
+};
+
+struct state_host {
+    char ip[64];
+    char mac[32];
+    char hostname[64];
+    char persona[32];
+    char priority[16];
+    char policy_action[32];
+    char dscp[16];
+    uint8_t confidence;
+    uint8_t pad[7];
+    uint64_t cur_rx_bytes;
+    uint64_t cur_tx_bytes;
+    uint64_t unused[2];      /* Conntrack sums of the previous pass, now always 0 */
+    uint64_t rx_bytes_total;
+    uint64_t tx_bytes_total;
+    uint64_t rx_bps;
+    uint64_t tx_bps;
+    int64_t last_seen;
+};
+
+_Static_assert(sizeof(struct state_header) == 96, "snapshot header layout changed");
+_Static_assert(sizeof(struct state_host) == 336, "snapshot record layout changed");
+
+static char g_path[256];
+static unsigned g_interval;
+static struct uloop_timeout g_timer;
+
+static void read_boot_id(char *buf, size_t len)
+{
+    memset(buf, 0, len);
+
+    FILE *f = fopen(BOOT_ID_FILE, "r");
+    if (!f)
+        return;
+    if (fgets(buf, (int)len, f))
+        buf[strcspn(buf, "\n")] = '\0';
+    fclose(f);
+}
+
+#define COPY_STR(dst, src) do { \
+        memset((dst), 0, sizeof(dst)); \
+        strncpy((dst), (src), sizeof(dst) - 1); \
+    } while (0)
+
+static void host_to_record(const struct host_stat *h, struct state_host *r)
+{
+    memset(r, 0, sizeof(*r));
+    COPY_STR(r->ip, h->ip);
+    COPY_STR(r->mac, h->mac);
+    COPY_STR(r->hostname, h->hostname);
+    COPY_STR(r->persona, h->persona);
+    COPY_STR(r->priority, h->priority);
+    COPY_STR(r->policy_action, h->policy_action);
+    COPY_STR(r->dscp, h->dscp);
+    r->confidence = h->confidence;
+    r->cur_rx_bytes = h->cur_rx_bytes;
+    r->cur_tx_bytes = h->cur_tx_bytes;
+    r->rx_bytes_total = h->rx_bytes_total;
+    r->tx_bytes_total = h->tx_bytes_total;
+    r->rx_bps = h->rx_bps;
+    r->tx_bps = h->tx_bps;
+    r->last_seen = (int64_t)h->last_seen;
+}
+
+static void record_to_host(const struct state_host *r, struct host_stat *h, bool same_boot)
+{
+    memset(h, 0, sizeof(*h));
+    COPY_STR(h->ip, r->ip);
+    COPY_STR(h->mac, r->mac);
+    COPY_STR(h->hostname, r->hostname);
+    COPY_STR(h->persona, r->persona);
+    COPY_STR(h->priority, r->priority);
+    COPY_STR(h->policy_action, r->policy_action);
+    COPY_STR(h->dscp, r->dscp);
+    h->confidence = r->confidence;
+    h->rx_bytes_total = r->rx_bytes_total;
+    h->tx_bytes_total = r->tx_bytes_total;
+    h->last_seen = (time_t)r->last_seen;
+
+    /* The last pass's bytes and rates only carry over within the same boot */
+    if (same_boot) {
+        h->cur_rx_bytes = r->cur_rx_bytes;
+        h->cur_tx_bytes = r->cur_tx_bytes;
+        h->rx_bps = r->rx_bps;
+        h->tx_bps = r->tx_bps;
+    }
+    h->used = true;
+}
+
+int qosd_state_save(void)
+{
+    if (!g_path[0])
+        return -1;
+
+    const struct host_stat *hosts = qosd_live_hosts();
+    char tmp[sizeof(g_path) + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", g_path);
+
+    FILE *f = fopen(tmp, "w");
+    if (!f)
+        return -1;
+
+    struct state_header hdr = {0};
+    memcpy(hdr.magic, STATE_MAGIC, sizeof(hdr.magic));
+    hdr.version = STATE_VERSION;
+    hdr.header_size = sizeof(hdr);
+    hdr.record_size = sizeof(struct state_host);
+    read_boot_id(hdr.boot_id, sizeof(hdr.boot_id));
+    hdr.saved_wall = (int64_t)time(NULL);
+    hdr.saved_mono_ms = qosd_monotonic_usec() / 1000;
+    hdr.prev_tick_ms = qosd_live_get_tick();
+
+    /* Header goes first with a placeholder crc and is rewritten at the end */
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+
+    uLong crc = crc32(0L, Z_NULL, 0);
+    for (int i = 0; ok && i < MAX_HOSTS; i++) {
+        if (!hosts[i].used)
+            continue;
+
+        struct state_host r;
+        host_to_record(&hosts[i], &r);
+        crc = crc32(crc, (const Bytef *)&r, sizeof(r));
+        ok = fwrite(&r, sizeof(r), 1, f) == 1;
+        hdr.count++;
+    }
+
+    hdr.crc = (uint32_t)crc;
+    if (ok)
+        ok = fseek(f, 0, SEEK_SET) == 0 && fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    if (fclose(f) != 0)
+        ok = false;
+
+    if (!ok || rename(tmp, g_path) != 0) {
+        unlink(tmp);
+        syslog(LOG_WARNING, "failed to write state snapshot %s", g_path);
+        return -1;
+    }
+    return 0;
+}
+
+static bool header_valid(const struct state_header *hdr, size_t size)
+{
+    if (memcmp(hdr->magic, STATE_MAGIC, sizeof(hdr->magic)) != 0)
+        return false;
+    if (hdr->version != STATE_VERSION || hdr->header_size < sizeof(*hdr))
+        return false;
+    if (hdr->record_size == 0 || hdr->count > MAX_HOSTS)
+        return false;
+    return (uint64_t)hdr->header_size + (uint64_t)hdr->record_size * hdr->count == size;
+}
+
+static int state_load(void)
+{
+    int fd = open(g_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct state_header)) {
+        close(fd);
+        return -1;
+    }
+
+    size_t size = (size_t)st.st_size;
+    const uint8_t *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    struct state_header hdr;
+    memcpy(&hdr, map, sizeof(hdr));
+
+    int ret = -1;
+    if (!header_valid(&hdr, size))
+        goto out;
+
+    const uint8_t *records = map + hdr.header_size;
+    if ((uint32_t)crc32(crc32(0L, Z_NULL, 0), records, hdr.record_size * hdr.count) != hdr.crc)
+        goto out;
+
+    char boot_id[sizeof(hdr.boot_id)];
+    read_boot_id(boot_id, sizeof(boot_id));
+    hdr.boot_id[sizeof(hdr.boot_id) - 1] = '\0';
+    bool same_boot = boot_id[0] && strcmp(boot_id, hdr.boot_id) == 0;
+
+    struct host_stat *hosts = qosd_live_hosts();
+    size_t copy = hdr.record_size < sizeof(struct state_host) ? hdr.record_size : sizeof(struct state_host);
+    for (uint32_t i = 0; i < hdr.count; i++) {
+        struct state_host r = {0};
+        memcpy(&r, records + (size_t)i * hdr.record_size, copy);
+        record_to_host(&r, &hosts[i], same_boot);
+    }
+
+    /* The next pass then diffs against the saved counters over the real gap */
+    if (same_boot)
+        qosd_live_set_tick(hdr.prev_tick_ms);
+
+    syslog(LOG_INFO, "restored %u hosts from %s (%s boot)", hdr.count, g_path,
+           same_boot ? "same" : "previous");
+    ret = 0;
+
+out:
+    munmap((void *)map, size);
+    if (ret)
+        syslog(LOG_WARNING, "ignoring invalid state snapshot %s", g_path);
+    return ret;
+}
+
+static void state_timer_cb(struct uloop_timeout *t)
+{
+    qosd_state_save();
+    uloop_timeout_set(t, (int)g_interval * 1000);
+}
+
+/* Restores the table from `path` and saves it every `interval` seconds */
+int qosd_state_init(const char *path, unsigned interval)
+{
+    if (!path || !*path || strlen(path) >= sizeof(g_path))
+        return -1;
+
+    strcpy(g_path, path);
+    g_interval = interval;
+
+    int ret = state_load();
+
+    if (g_interval) {
+        g_timer.cb = state_timer_cb;
+        uloop_timeout_set(&g_timer, (int)g_interval * 1000);
+    }
+    return ret;
+}
+
+void qosd_state_done(void)
+{
+    if (!g_path[0])
+        return;
+
+    uloop_timeout_cancel(&g_timer);
+    qosd_state_save();
+    g_path[0] = '\0';
+}
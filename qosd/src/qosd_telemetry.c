@@ -0,0 +1,488 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include <libubox/uloop.h>
+#include <syslog.h>
+
+#include "qosd.h"
+
+/*
+ * qosd_classify event emission.
+ *
+ * With an aggregation window, events are grouped by flow shape and
+ * decision (src, dst, proto, ports, persona, priority, policy_action,
+ * dscp) and each group is logged once per window with a count and the
+ * first/last time it was seen. Descriptive fields (hostname, hints,
+ * bytes, latency) carry the most recent value.
+ *
+ * A per-source token bucket bounds how many distinct groups, or plain
+ * events without a window, one source may open per second. What it
+ * rejects is counted and reported as a qosd_classify_suppressed event.
+ * Once AGG_MAX_SOURCES sources are tracked, a source whose bucket has
+ * refilled makes room for a new one; if none has, new sources share a
+ * single bucket reported as src "other".
+ *
+ * Entries keep their strings in one heap buffer per entry that is reused
+ * across windows, so nothing is truncated, neither what is matched on nor
+ * what is logged.
+ */
+
+#define AGG_TABLE_SIZE     256                      /* Power of two */
+#define AGG_MAX_ENTRIES    (AGG_TABLE_SIZE / 4 * 3) /* Flush early beyond this */
+#define AGG_MAX_SOURCES    128
+#define SUPPRESS_REPORT_S  10                       /* Without a window */
+
+enum {
+    AGG_SRC,
+    AGG_DST,
+    AGG_PROTO,
+    AGG_HOSTNAME,
+    AGG_SERVICE,
+    AGG_DNS,
+    AGG_APP,
+    __AGG_STR_MAX
+};
+
+struct agg_entry {
+    uint32_t hash;
+    bool used;
+    char *strs;                      /* The strings below, back to back */
+    size_t strs_size;
+    const char *str[__AGG_STR_MAX];  /* Point into strs */
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint64_t bytes_total;
+    uint32_t latency_ms;
+    struct persona_result res;
+    uint32_t count;
+    time_t first_seen;
+    time_t last_seen;
+};
+
+struct source_bucket {
+    char *src;
+    double tokens;
+    uint64_t refill_ms;
+    uint64_t suppressed;
+    bool used;
+};
+
+static unsigned g_window;
+static double g_rate;
+static double g_burst;
+
+static struct agg_entry *g_table;
+static unsigned g_entries;
+static struct source_bucket g_sources[AGG_MAX_SOURCES];
+static struct source_bucket g_overflow = { .src = "other" };
+static struct uloop_timeout g_flush_timer;
+static struct json_writer g_jw;
+
+static uint32_t hash_str(uint32_t h, const char *s)
+{
+    for (const unsigned char *p = (const unsigned char *)s; *p; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h * 16777619u;
+}
+
+static uint32_t event_hash(const struct classify_event *ev)
+{
+    uint32_t h = 2166136261u;
+    h = hash_str(h, ev->src);
+    h = hash_str(h, ev->dst);
+    h = hash_str(h, ev->proto);
+    h ^= ((uint32_t)ev->src_port << 16) | ev->dst_port;
+    h *= 16777619u;
+    h = hash_str(h, ev->res->persona);
+    h = hash_str(h, ev->res->priority);
+    h = hash_str(h, ev->res->policy_action);
+    return hash_str(h, ev->res->dscp);
+}
+
+static inline const char *str_or_empty(const char *s)
+{
+    return s ? s : "";
+}
+
+/* The persona result strings are fixed arrays on both sides */
+static bool entry_matches(const struct agg_entry *e, uint32_t hash, const struct classify_event *ev)
+{
+    return e->hash == hash &&
+           e->src_port == ev->src_port && e->dst_port == ev->dst_port &&
+           !strcmp(e->str[AGG_SRC], str_or_empty(ev->src)) &&
+           !strcmp(e->str[AGG_DST], str_or_empty(ev->dst)) &&
+           !strcmp(e->str[AGG_PROTO], str_or_empty(ev->proto)) &&
+           !strcmp(e->res.persona, ev->res->persona) &&
+           !strcmp(e->res.priority, ev->res->priority) &&
+           !strcmp(e->res.policy_action, ev->res->policy_action) &&
+           !strcmp(e->res.dscp, ev->res->dscp);
+}
+
+/* Stores every string of ev in e, false if the buffer could not grow */
+static bool entry_store(struct agg_entry *e, const struct classify_event *ev)
+{
+    const char *in[__AGG_STR_MAX] = {
+        [AGG_SRC]      = str_or_empty(ev->src),
+        [AGG_DST]      = str_or_empty(ev->dst),
+        [AGG_PROTO]    = str_or_empty(ev->proto),
+        [AGG_HOSTNAME] = str_or_empty(ev->hostname),
+        [AGG_SERVICE]  = str_or_empty(ev->service_hint),
+        [AGG_DNS]      = str_or_empty(ev->dns_name),
+        [AGG_APP]      = str_or_empty(ev->app_hint),
+    };
+    size_t len[__AGG_STR_MAX], need = 0;
+
+    for (int i = 0; i < __AGG_STR_MAX; i++) {
+        len[i] = strlen(in[i]) + 1;
+        need += len[i];
+    }
+
+    if (need > e->strs_size) {
+        char *strs = realloc(e->strs, need);
+        if (!strs)
+            return false;
+        e->strs = strs;
+        e->strs_size = need;
+    }
+
+    /* The key strings are rewritten unchanged, they come first */
+    char *o = e->strs;
+    for (int i = 0; i < __AGG_STR_MAX; i++) {
+        memcpy(o, in[i], len[i]);
+        e->str[i] = o;
+        o += len[i];
+    }
+    return true;
+}
+
+static bool entry_update(struct agg_entry *e, const struct classify_event *ev)
+{
+    if (!entry_store(e, ev))
+        return false;
+    e->bytes_total = ev->bytes_total;
+    e->latency_ms = ev->latency_ms;
+    e->res.confidence = ev->res->confidence;
+    return true;
+}
+
+static void emit(const struct classify_event *ev, const struct agg_entry *agg)
+{
+    char first[32], last[32];
+
+    json_begin(&g_jw);
+    json_add_string(&g_jw, "event", "qosd_classify");
+    json_add_string(&g_jw, "timestamp", qosd_timestamp_now());
+    json_add_string(&g_jw, "src", ev->src);
+    json_add_string(&g_jw, "dst", ev->dst);
+    json_add_string(&g_jw, "proto", ev->proto);
+    json_add_string(&g_jw, "category", ev->res->persona);
+    json_add_string(&g_jw, "priority", ev->res->priority);
+    json_add_string(&g_jw, "router", qosd_router_id());
+    json_add_u64(&g_jw, "src_port", ev->src_port);
+    json_add_u64(&g_jw, "dst_port", ev->dst_port);
+    json_add_string(&g_jw, "hostname", ev->hostname);
+    json_add_string(&g_jw, "service_hint", ev->service_hint);
+    json_add_string(&g_jw, "dns_name", ev->dns_name);
+    json_add_string(&g_jw, "policy_action", ev->res->policy_action);
+    json_add_string(&g_jw, "dscp", ev->res->dscp);
+    json_add_u64(&g_jw, "confidence", ev->res->confidence);
+    json_add_u64(&g_jw, "bytes_total", ev->bytes_total);
+    json_add_u64(&g_jw, "latency_ms", ev->latency_ms);
+    json_add_string(&g_jw, "app_hint", ev->app_hint);
+
+    if (agg) {
+        qosd_iso8601(agg->first_seen, first, sizeof(first));
+        qosd_iso8601(agg->last_seen, last, sizeof(last));
+        json_add_u64(&g_jw, "count", agg->count);
+        json_add_string(&g_jw, "first_seen", first);
+        json_add_string(&g_jw, "last_seen", last);
+        json_add_u64(&g_jw, "window_s", g_window);
+    }
+
+    const char *payload = json_end(&g_jw);
+    if (payload)
+        syslog(LOG_INFO, "%s", payload);
+}
+
+static void emit_suppressed(const struct source_bucket *s, unsigned period)
+{
+    json_begin(&g_jw);
+    json_add_string(&g_jw, "event", "qosd_classify_suppressed");
+    json_add_string(&g_jw, "timestamp", qosd_timestamp_now());
+    json_add_string(&g_jw, "src", s->src);
+    json_add_string(&g_jw, "router", qosd_router_id());
+    json_add_u64(&g_jw, "suppressed", s->suppressed);
+    json_add_u64(&g_jw, "window_s", period);
+
+    const char *payload = json_end(&g_jw);
+    if (payload)
+        syslog(LOG_INFO, "%s", payload);
+}
+
+static void refill(struct source_bucket *s, uint64_t now_ms)
+{
+    s->tokens += (double)(now_ms - s->refill_ms) / 1000.0 * g_rate;
+    if (s->tokens > g_burst)
+        s->tokens = g_burst;
+    s->refill_ms = now_ms;
+}
+
+static void source_forget(struct source_bucket *s, unsigned period)
+{
+    if (s->suppressed)
+        emit_suppressed(s, period);
+    free(s->src);
+    memset(s, 0, sizeof(*s));
+}
+
+/*
+ * A slot for a source seen for the first time: a free one, or one whose
+ * bucket is full again, which is as good as forgotten. NULL if neither.
+ */
+static struct source_bucket *source_slot(uint64_t now_ms)
+{
+    unsigned period = g_window ? g_window : SUPPRESS_REPORT_S;
+
+    for (int i = 0; i < AGG_MAX_SOURCES; i++) {
+        if (!g_sources[i].used)
+            return &g_sources[i];
+    }
+    for (int i = 0; i < AGG_MAX_SOURCES; i++) {
+        struct source_bucket *s = &g_sources[i];
+        refill(s, now_ms);
+        if (s->tokens >= g_burst) {
+            source_forget(s, period);
+            return s;
+        }
+    }
+    return NULL;
+}
+
+/* Takes one token from the source's bucket; false means suppress */
+static bool source_admit(const char *src)
+{
+    if (g_rate <= 0.0)
+        return true;
+
+    uint64_t now_ms = qosd_monotonic_usec() / 1000;
+    struct source_bucket *s = NULL;
+
+    src = str_or_empty(src);
+    for (int i = 0; i < AGG_MAX_SOURCES; i++) {
+        if (g_sources[i].used && !strcmp(g_sources[i].src, src)) {
+            s = &g_sources[i];
+            break;
+        }
+    }
+
+    if (!s) {
+        char *copy = strdup(src);
+        s = copy ? source_slot(now_ms) : NULL;
+        if (s) {
+            s->src = copy;
+            s->tokens = g_burst;
+            s->refill_ms = now_ms;
+            s->used = true;
+        } else {
+            free(copy);
+            s = &g_overflow;
+            if (!s->used) {
+                s->tokens = g_burst;
+                s->refill_ms = now_ms;
+                s->used = true;
+            }
+        }
+    }
+
+    refill(s, now_ms);
+    if (s->tokens >= 1.0) {
+        s->tokens -= 1.0;
+        return true;
+    }
+    s->suppressed++;
+    return false;
+}
+
+static void flush_groups(void)
+{
+    for (unsigned i = 0; g_entries && i < AGG_TABLE_SIZE; i++) {
+        struct agg_entry *e = &g_table[i];
+        if (!e->used)
+            continue;
+
+        struct classify_event ev = {
+            .src = e->str[AGG_SRC],
+            .dst = e->str[AGG_DST],
+            .proto = e->str[AGG_PROTO],
+            .src_port = e->src_port,
+            .dst_port = e->dst_port,
+            .hostname = e->str[AGG_HOSTNAME],
+            .service_hint = e->str[AGG_SERVICE],
+            .dns_name = e->str[AGG_DNS],
+            .app_hint = e->str[AGG_APP],
+            .bytes_total = e->bytes_total,
+            .latency_ms = e->latency_ms,
+            .res = &e->res,
+        };
+        emit(&ev, e);
+        e->used = false;
+    }
+    g_entries = 0;
+}
+
+static void flush(void)
+{
+    unsigned period = g_window ? g_window : SUPPRESS_REPORT_S;
+    uint64_t now_ms = qosd_monotonic_usec() / 1000;
+
+    flush_groups();
+
+    /* Report suppressions and forget sources whose bucket is full again */
+    for (int i = 0; i <= AGG_MAX_SOURCES; i++) {
+        struct source_bucket *s = i < AGG_MAX_SOURCES ? &g_sources[i] : &g_overflow;
+        if (!s->used)
+            continue;
+        if (s->suppressed) {
+            emit_suppressed(s, period);
+            s->suppressed = 0;
+        }
+        refill(s, now_ms);
+        if (s->tokens < g_burst)
+            continue;
+        if (s == &g_overflow)
+            s->used = false;
+        else
+            source_forget(s, period);
+    }
+}
+
+static bool pending(void)
+{
+    if (g_entries)
+        return true;
+    for (int i = 0; i < AGG_MAX_SOURCES; i++) {
+        if (g_sources[i].used)
+            return true;
+    }
+    return g_overflow.used;
+}
+
+static void flush_timer_cb(struct uloop_timeout *t)
+{
+    flush();
+    if (pending())
+        uloop_timeout_set(t, (int)(g_window ? g_window : SUPPRESS_REPORT_S) * 1000);
+}
+
+static void arm_flush_timer(void)
+{
+    if (!g_flush_timer.pending)
+        uloop_timeout_set(&g_flush_timer, (int)(g_window ? g_window : SUPPRESS_REPORT_S) * 1000);
+}
+
+static void aggregate(const struct classify_event *ev)
+{
+    uint32_t hash = event_hash(ev);
+    uint32_t mask = AGG_TABLE_SIZE - 1;
+    uint32_t i = hash & mask;
+
+    while (g_table[i].used) {
+        if (entry_matches(&g_table[i], hash, ev)) {
+            struct agg_entry *e = &g_table[i];
+            e->count++;
+            e->last_seen = time(NULL);
+            entry_update(e, ev);   /* Keeps the previous values if it fails */
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+
+    if (!source_admit(ev->src))
+        return;
+
+    /* Suppressions are still reported once per window */
+    if (g_entries >= AGG_MAX_ENTRIES) {
+        flush_groups();
+        i = hash & mask;
+    }
+
+    /* The string buffer stays with the slot */
+    struct agg_entry *e = &g_table[i];
+    char *strs = e->strs;
+    size_t strs_size = e->strs_size;
+    memset(e, 0, sizeof(*e));
+    e->strs = strs;
+    e->strs_size = strs_size;
+
+    if (!entry_update(e, ev)) {
+        emit(ev, NULL);
+        return;
+    }
+    e->hash = hash;
+    e->used = true;
+    e->src_port = ev->src_port;
+    e->dst_port = ev->dst_port;
+    e->res = *ev->res;
+    e->count = 1;
+    e->first_seen = e->last_seen = time(NULL);
+    g_entries++;
+}
+
+void qosd_telemetry_classify(const struct classify_event *ev)
+{
+    if (!g_table) {
+        if (source_admit(ev->src))
+            emit(ev, NULL);
+    } else {
+        aggregate(ev);
+    }
+
+    if (g_table || g_rate > 0.0)
+        arm_flush_timer();
+}
+
+/*
+ * window: aggregation window in seconds, 0 logs every event.
+ * rate/burst: distinct events per second and bucket depth per source,
+ * rate 0 disables limiting.
+ */
+int qosd_telemetry_init(unsigned window, unsigned rate, unsigned burst)
+{
+    g_window = window;
+    g_rate = rate;
+    g_burst = burst ? burst : (rate ? rate : 1);
+    g_flush_timer.cb = flush_timer_cb;
+
+    if (!window)
+        return 0;
+
+    g_table = calloc(AGG_TABLE_SIZE, sizeof(*g_table));
+    if (!g_table) {
+        g_window = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void qosd_telemetry_done(void)
+{
+    uloop_timeout_cancel(&g_flush_timer);
+    flush();
+    for (int i = 0; i < AGG_MAX_SOURCES; i++) {
+        if (g_sources[i].used)
+            source_forget(&g_sources[i], 0);
+    }
+    g_overflow.used = false;
+    for (unsigned i = 0; g_table && i < AGG_TABLE_SIZE; i++)
+        free(g_table[i].strs);
+    free(g_table);
+    g_table = NULL;
+    g_entries = 0;
+    json_free(&g_jw);
+}
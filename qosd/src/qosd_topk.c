@@ -0,0 +1,508 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <libubus.h>
+#include <libubox/blobmsg.h>
+#include <libubox/uloop.h>
+
+#include "qosd.h"
+
+/*
+ * Heavy-hitter tracking over a sliding window in fixed memory.
+ *
+ * Callers pass every conntrack entry in with the bytes it moved since the
+ * previous pass, as qosd_flows.c works them out. The bounds below cover
+ * those bytes; whatever flows evicted from an overfull flow table moved
+ * is missing from both (see qosd_stats.flow_evictions).
+ *
+ * Deltas feed one sketch per dimension (talkers, destinations, pairs,
+ * ports): a Space-Saving summary of TOPK_CAPACITY counters that keeps
+ * the candidate heavy hitters, and a Count-Min sketch that bounds the
+ * bytes of any key, including ones the summary has evicted. The window
+ * is split into TOPK_SLOTS sub-windows with their own sketches; a query
+ * merges the sub-windows it covers, and the oldest one is cleared as
+ * time moves on.
+ *
+ * Every thread accumulates a pass into a private topk_acc, which the
+ * uloop thread folds into the current sub-window when the pass ends.
+ */
+
+#define TOPK_CAPACITY    32     /* Space-Saving counters per dimension */
+#define TOPK_CMS_DEPTH   4
+#define TOPK_CMS_WIDTH   128    /* Power of two */
+#define TOPK_SLOTS       6      /* Sub-windows per window */
+#define TOPK_KEY_LEN     96     /* "<ipv6>><ipv6>" */
+
+enum {
+    TOPK_TALKERS,
+    TOPK_DESTINATIONS,
+    TOPK_PAIRS,
+    TOPK_PORTS,
+    __TOPK_DIM_MAX
+};
+
+static const char *const dim_names[__TOPK_DIM_MAX] = {
+    "talkers", "destinations", "pairs", "ports"
+};
+
+struct ss_counter {
+    char key[TOPK_KEY_LEN];
+    uint32_t hash;
+    uint64_t count;   /* Upper bound of the key's bytes */
+    uint64_t error;   /* count - error is a lower bound */
+};
+
+struct ss_summary {
+    unsigned used;
+    struct ss_counter c[TOPK_CAPACITY];
+};
+
+struct topk_sketch {
+    struct ss_summary ss[__TOPK_DIM_MAX];
+    uint64_t cms[__TOPK_DIM_MAX][TOPK_CMS_DEPTH][TOPK_CMS_WIDTH];
+};
+
+struct topk_acc {
+    struct topk_sketch sk;
+    bool dirty;
+};
+
+struct topk_slot {
+    struct topk_sketch sk;
+    uint64_t epoch;   /* Sub-window number this slot holds */
+};
+
+static struct topk_slot *g_slots;
+static struct topk_acc *g_inline_acc;
+static unsigned g_slot_len;     /* Seconds per sub-window */
+static uint64_t g_epoch;
+static struct uloop_timeout g_timer;
+
+static uint32_t hash_key(const char *s)
+{
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)s; *p; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static inline uint32_t cms_index(uint32_t hash, unsigned row)
+{
+    /* Rows derived from one hash (Kirsch-Mitzenmacher) */
+    uint32_t h2 = (hash >> 16) | (hash << 16);
+    return (hash + row * (h2 | 1)) & (TOPK_CMS_WIDTH - 1);
+}
+
+static uint64_t cms_estimate(uint64_t cms[TOPK_CMS_DEPTH][TOPK_CMS_WIDTH], uint32_t hash)
+{
+    uint64_t est = UINT64_MAX;
+    for (unsigned r = 0; r < TOPK_CMS_DEPTH; r++) {
+        uint64_t v = cms[r][cms_index(hash, r)];
+        if (v < est)
+            est = v;
+    }
+    return est;
+}
+
+static struct ss_counter *ss_find(struct ss_summary *ss, const char *key, uint32_t hash)
+{
+    for (unsigned i = 0; i < ss->used; i++) {
+        if (ss->c[i].hash == hash && strcmp(ss->c[i].key, key) == 0)
+            return &ss->c[i];
+    }
+    return NULL;
+}
+
+static void ss_add(struct ss_summary *ss, const char *key, uint32_t hash, uint64_t count, uint64_t error)
+{
+    struct ss_counter *c = ss_find(ss, key, hash);
+    if (c) {
+        c->count += count;
+        c->error += error;
+        return;
+    }
+
+    if (ss->used < TOPK_CAPACITY) {
+        c = &ss->c[ss->used++];
+        c->error = error;
+        c->count = count;
+    } else {
+        /* Evict the smallest counter; the newcomer inherits its count as error */
+        c = &ss->c[0];
+        for (unsigned i = 1; i < TOPK_CAPACITY; i++) {
+            if (ss->c[i].count < c->count)
+                c = &ss->c[i];
+        }
+        c->error = c->count + error;
+        c->count += count;
+    }
+
+    strncpy(c->key, key, sizeof(c->key) - 1);
+    c->key[sizeof(c->key) - 1] = '\0';
+    c->hash = hash;
+}
+
+static uint64_t ss_min(const struct ss_summary *ss)
+{
+    if (ss->used < TOPK_CAPACITY)
+        return 0;
+
+    uint64_t min = UINT64_MAX;
+    for (unsigned i = 0; i < ss->used; i++) {
+        if (ss->c[i].count < min)
+            min = ss->c[i].count;
+    }
+    return min;
+}
+
+static void sketch_add(struct topk_sketch *sk, int dim, const char *key, uint64_t bytes)
+{
+    uint32_t hash = hash_key(key);
+
+    for (unsigned r = 0; r < TOPK_CMS_DEPTH; r++)
+        sk->cms[dim][r][cms_index(hash, r)] += bytes;
+    ss_add(&sk->ss[dim], key, hash, bytes, 0);
+}
+
+static void sketch_merge(struct topk_sketch *dst, const struct topk_sketch *src)
+{
+    for (int d = 0; d < __TOPK_DIM_MAX; d++) {
+        for (unsigned r = 0; r < TOPK_CMS_DEPTH; r++) {
+            for (unsigned i = 0; i < TOPK_CMS_WIDTH; i++)
+                dst->cms[d][r][i] += src->cms[d][r][i];
+        }
+
+        /*
+         * A key missing from a full summary may have moved up to its
+         * smallest count there. Keys only `dst` holds take that on as
+         * error, so their counts stay upper bounds after the merge.
+         */
+        const struct ss_summary *ss = &src->ss[d];
+        uint64_t absent = ss_min(ss);
+        for (unsigned i = 0; absent && i < dst->ss[d].used; i++) {
+            struct ss_counter *c = &dst->ss[d].c[i];
+            if (!ss_find((struct ss_summary *)ss, c->key, c->hash)) {
+                c->count += absent;
+                c->error += absent;
+            }
+        }
+
+        for (unsigned i = 0; i < ss->used; i++)
+            ss_add(&dst->ss[d], ss->c[i].key, ss->c[i].hash, ss->c[i].count, ss->c[i].error);
+    }
+}
+
+struct topk_acc *qosd_topk_acc_new(void)
+{
+    if (!g_slots)
+        return NULL;
+    return calloc(1, sizeof(struct topk_acc));
+}
+
+void qosd_topk_acc_free(struct topk_acc *acc)
+{
+    free(acc);
+}
+
+/*
+ * Feeds one conntrack entry and the bytes it moved into `acc`; NULL is the
+ * uloop thread's own accumulator. Safe to call from several threads with
+ * distinct accs.
+ */
+void qosd_topk_account(struct topk_acc *acc, const struct nfct_entry *e, uint64_t bytes)
+{
+    if (!g_slots || !bytes)
+        return;
+    if (!acc)
+        acc = g_inline_acc;
+
+    char key[TOPK_KEY_LEN];
+    struct topk_sketch *sk = &acc->sk;
+
+    sketch_add(sk, TOPK_TALKERS, e->src, bytes);
+    sketch_add(sk, TOPK_DESTINATIONS, e->dst, bytes);
+    snprintf(key, sizeof(key), "%s>%s", e->src, e->dst);
+    sketch_add(sk, TOPK_PAIRS, key, bytes);
+    snprintf(key, sizeof(key), "%s/%u", e->proto, e->dport);
+    sketch_add(sk, TOPK_PORTS, key, bytes);
+    acc->dirty = true;
+}
+
+/* Clears sub-windows that fell out of the window since the last call */
+static struct topk_slot *advance(void)
+{
+    uint64_t epoch = qosd_monotonic_usec() / 1000000ULL / g_slot_len;
+
+    if (epoch != g_epoch) {
+        uint64_t from = epoch - g_epoch > TOPK_SLOTS ? epoch - TOPK_SLOTS + 1 : g_epoch + 1;
+        for (uint64_t e = from; e <= epoch; e++) {
+            struct topk_slot *s = &g_slots[e % TOPK_SLOTS];
+            memset(&s->sk, 0, sizeof(s->sk));
+            s->epoch = e;
+        }
+        g_epoch = epoch;
+    }
+    return &g_slots[epoch % TOPK_SLOTS];
+}
+
+/* Folds a finished pass into the current sub-window (uloop thread only) */
+void qosd_topk_commit(struct topk_acc *acc)
+{
+    if (!g_slots)
+        return;
+    if (!acc)
+        acc = g_inline_acc;
+    if (!acc->dirty)
+        return;
+
+    sketch_merge(&advance()->sk, &acc->sk);
+
+    memset(&acc->sk, 0, sizeof(acc->sk));
+    acc->dirty = false;
+}
+
+struct topk_candidate {
+    const char *key;
+    uint32_t hash;
+    uint64_t bytes;
+    uint64_t error;
+};
+
+static int cmp_candidate(const void *a, const void *b)
+{
+    const struct topk_candidate *ca = a, *cb = b;
+    return ca->bytes < cb->bytes ? 1 : (ca->bytes > cb->bytes ? -1 : 0);
+}
+
+/*
+ * Estimate for `hash` over the selected sub-windows: `bytes` is an upper
+ * bound and `bytes - error` a lower one. Where a summary holds the key,
+ * its counter gives both, and the Count-Min estimate may lower the upper
+ * bound; otherwise the key either never appeared (summary not full) or is
+ * bounded by both the smallest counter and the Count-Min estimate.
+ */
+static void estimate(int dim, const char *key, uint32_t hash, unsigned nslots,
+                     uint64_t *bytes, uint64_t *error)
+{
+    *bytes = *error = 0;
+
+    for (unsigned i = 0; i < nslots; i++) {
+        struct topk_slot *s = &g_slots[(g_epoch - i) % TOPK_SLOTS];
+        struct ss_summary *ss = &s->sk.ss[dim];
+        if (s->epoch != g_epoch - i)
+            continue;
+
+        const struct ss_counter *c = ss_find(ss, key, hash);
+        uint64_t cms = cms_estimate(s->sk.cms[dim], hash);
+        if (c) {
+            uint64_t low = c->count - c->error;
+            uint64_t high = cms < c->count ? cms : c->count;
+            if (high < low)
+                high = low;
+            *bytes += high;
+            *error += high - low;
+            continue;
+        }
+
+        uint64_t bound = ss_min(ss);
+        if (cms < bound)
+            bound = cms;
+        *bytes += bound;
+        *error += bound;
+    }
+}
+
+/* Ranks the keys held by the summaries in the window, heaviest first */
+static unsigned collect_top(int dim, unsigned nslots, struct topk_candidate *cand)
+{
+    unsigned n = 0;
+
+    /* Candidates are the union of the summaries in the window */
+    for (unsigned i = 0; i < nslots; i++) {
+        struct topk_slot *s = &g_slots[(g_epoch - i) % TOPK_SLOTS];
+        if (s->epoch != g_epoch - i)
+            continue;
+
+        struct ss_summary *ss = &s->sk.ss[dim];
+        for (unsigned j = 0; j < ss->used; j++) {
+            unsigned k;
+            for (k = 0; k < n; k++) {
+                if (cand[k].hash == ss->c[j].hash && strcmp(cand[k].key, ss->c[j].key) == 0)
+                    break;
+            }
+            if (k == n) {
+                cand[n].key = ss->c[j].key;
+                cand[n].hash = ss->c[j].hash;
+                n++;
+            }
+        }
+    }
+
+    for (unsigned k = 0; k < n; k++)
+        estimate(dim, cand[k].key, cand[k].hash, nslots, &cand[k].bytes, &cand[k].error);
+    qsort(cand, n, sizeof(cand[0]), cmp_candidate);
+    return n;
+}
+
+static struct topk_candidate g_cand[TOPK_SLOTS * TOPK_CAPACITY];
+
+static void add_top(struct blob_buf *b, int dim, unsigned nslots, unsigned limit)
+{
+    struct topk_candidate *cand = g_cand;
+    unsigned n = collect_top(dim, nslots, cand);
+
+    void *arr = blobmsg_open_array(b, dim_names[dim]);
+    for (unsigned k = 0; k < n && k < limit; k++) {
+        void *t = blobmsg_open_table(b, NULL);
+        blobmsg_add_string(b, "key", cand[k].key);
+        blobmsg_add_u64(b, "bytes", cand[k].bytes);
+        blobmsg_add_u64(b, "error", cand[k].error);
+        blobmsg_close_table(b, t);
+    }
+    blobmsg_close_array(b, arr);
+}
+
+/*
+ * Heaviest destinations over the whole window. The keys point into the
+ * sketches and stay valid until the next commit on the uloop thread.
+ */
+unsigned qosd_topk_destinations(const char **keys, unsigned max)
+{
+    if (!g_slots)
+        return 0;
+
+    unsigned n = collect_top(TOPK_DESTINATIONS, TOPK_SLOTS, g_cand);
+    if (n > max)
+        n = max;
+    for (unsigned k = 0; k < n; k++)
+        keys[k] = g_cand[k].key;
+    return n;
+}
+
+enum {
+    TOP_DIMENSION,
+    TOP_LIMIT,
+    TOP_WINDOW,
+    TOP_KEY,
+    __TOP_MAX
+};
+
+static const struct blobmsg_policy top_policy[__TOP_MAX] = {
+    [TOP_DIMENSION] = { .name = "dimension", .type = BLOBMSG_TYPE_STRING },
+    [TOP_LIMIT]     = { .name = "limit",     .type = BLOBMSG_TYPE_INT32 },
+    [TOP_WINDOW]    = { .name = "window",    .type = BLOBMSG_TYPE_INT32 },
+    [TOP_KEY]       = { .name = "key",       .type = BLOBMSG_TYPE_STRING },
+};
+
+static int qosd_top_handler(struct ubus_context *ctx, struct ubus_object *obj,
+                            struct ubus_request_data *req, const char *method,
+                            struct blob_attr *msg)
+{
+    (void)obj;
+    (void)method;
+
+    struct blob_attr *tb[__TOP_MAX];
+    blobmsg_parse(top_policy, __TOP_MAX, tb, blob_data(msg), blob_len(msg));
+
+    int dim = -1;
+    if (tb[TOP_DIMENSION]) {
+        const char *name = blobmsg_get_string(tb[TOP_DIMENSION]);
+        for (dim = 0; dim < __TOPK_DIM_MAX; dim++) {
+            if (!strcmp(name, dim_names[dim]))
+                break;
+        }
+        if (dim == __TOPK_DIM_MAX)
+            return UBUS_STATUS_INVALID_ARGUMENT;
+    }
+    if (tb[TOP_KEY] && dim < 0)
+        return UBUS_STATUS_INVALID_ARGUMENT;
+
+    if (!g_slots)
+        return UBUS_STATUS_NOT_SUPPORTED;
+
+    unsigned limit = tb[TOP_LIMIT] ? blobmsg_get_u32(tb[TOP_LIMIT]) : 10;
+    if (!limit || limit > TOPK_CAPACITY)
+        limit = TOPK_CAPACITY;
+
+    unsigned nslots = TOPK_SLOTS;
+    if (tb[TOP_WINDOW]) {
+        nslots = (blobmsg_get_u32(tb[TOP_WINDOW]) + g_slot_len - 1) / g_slot_len;
+        if (!nslots || nslots > TOPK_SLOTS)
+            nslots = TOPK_SLOTS;
+    }
+
+    /* Serve whatever the last finished pass produced */
+    qosd_live_refresh();
+    advance();
+
+    static struct blob_buf b;
+    blob_buf_init(&b, 0);
+    blobmsg_add_u32(&b, "window", nslots * g_slot_len);
+
+    if (tb[TOP_KEY]) {
+        const char *key = blobmsg_get_string(tb[TOP_KEY]);
+        uint64_t bytes, error;
+        estimate(dim, key, hash_key(key), nslots, &bytes, &error);
+        blobmsg_add_string(&b, "dimension", dim_names[dim]);
+        blobmsg_add_string(&b, "key", key);
+        blobmsg_add_u64(&b, "bytes", bytes);
+        blobmsg_add_u64(&b, "error", error);
+    } else {
+        for (int d = 0; d < __TOPK_DIM_MAX; d++) {
+            if (dim < 0 || d == dim)
+                add_top(&b, d, nslots, limit);
+        }
+    }
+
+    return ubus_send_reply(ctx, req, b.head);
+}
+
+void qosd_topk_method_init(struct ubus_method *method)
+{
+    *method = (struct ubus_method)UBUS_METHOD("top", qosd_top_handler, top_policy);
+}
+
+/* Keeps sub-windows filled when nobody else triggers sampling */
+static void topk_timer_cb(struct uloop_timeout *t)
+{
+    qosd_live_refresh();
+    uloop_timeout_set(t, (int)g_slot_len * 1000);
+}
+
+/* window: seconds covered by `top`, 0 disables the sketches */
+int qosd_topk_init(unsigned window)
+{
+    if (!window)
+        return 0;
+
+    g_slot_len = (window + TOPK_SLOTS - 1) / TOPK_SLOTS;
+    g_slots = calloc(TOPK_SLOTS, sizeof(*g_slots));
+    g_inline_acc = calloc(1, sizeof(*g_inline_acc));
+    if (!g_slots || !g_inline_acc) {
+        qosd_topk_done();
+        return -1;
+    }
+
+    g_epoch = qosd_monotonic_usec() / 1000000ULL / g_slot_len;
+    for (unsigned i = 0; i < TOPK_SLOTS; i++)
+        g_slots[i].epoch = UINT64_MAX;
+    g_slots[g_epoch % TOPK_SLOTS].epoch = g_epoch;
+
+    g_timer.cb = topk_timer_cb;
+    uloop_timeout_set(&g_timer, (int)g_slot_len * 1000);
+    return 0;
+}
+
+void qosd_topk_done(void)
+{
+    uloop_timeout_cancel(&g_timer);
+    free(g_slots);
+    free(g_inline_acc);
+    g_slots = NULL;
+    g_inline_acc = NULL;
+}